@@ -4,15 +4,25 @@
 
 ..\..\TARL\display.c
 
+..\..\TARL\i2c.c
+
 ..\..\TARL\lcd.c
 
-..\..\TARL\lcd_port.c
+..\..\TARL\lcd_if.c
 
 ..\..\TARL\millis.c
 
 ..\..\TARL\serial.c
 
+format.c
+
 io.c
 
+lcd_twi.c
+
 main.c
 
+profile.c
+
+twi.c
+
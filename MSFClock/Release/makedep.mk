@@ -14,7 +14,15 @@
 
 ..\..\TARL\serial.c
 
+format.c
+
 io.c
 
+lcd_twi.c
+
 main.c
 
+profile.c
+
+twi.c
+
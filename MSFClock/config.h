@@ -20,6 +20,13 @@ typedef uint8_t bool;
 
 //#define DEBUG
 
+// Count the CPU cycles taken by the interrupt handlers and the main
+// parts of the main loop using timer 1. Send 'p' on the serial port
+// for the statistics. With COHERENT_ADC timer 1 is shared with the ADC
+// and an interrupt every period adds around 5% to the load.
+// Not with DEBUG as the two together need more RAM than there is.
+//#define PROFILE
+
 #define LED_OUTPUT_PORT_REG   PORTB
 #define LED_OUTPUT_PIN_REG    PINB
 #define LED_OUTPUT_DDR_REG    DDRB
@@ -69,9 +76,32 @@ typedef uint8_t bool;
 #define LCD_WIDTH 16
 #define LCD_HEIGHT 2
 
+// Define to detect the carrier with thresholds set at fixed margins
+// above an estimate of the noise floor. Otherwise the thresholds are
+// scaled from the average input level, which includes the carrier.
+#define NOISE_FLOOR_DETECTOR
+
+// Define to trigger the ADC from timer 1, which runs from the same clock
+// as the LO, at a rate worked out from F_CPU and CLOCK_FREQUENCY so the
+// Goertzel bin sits exactly on the IF. Otherwise the ADC free runs at a
+// rate close to it, 1.1Hz off in a bin 105Hz wide at 16MHz and 59.3kHz.
+// A triggered conversion is half an ADC clock longer so only 12 fit in
+// each sample rather than 13, which costs more on a weak signal.
+//#define COHERENT_ADC
+
+// Define to ignore blocks where the bins either side of the carrier
+// rise along with it, as they do for broadband noise such as impulses
+// from switch mode supplies. The last carrier decision stands instead.
+// The bins need the default GOERTZEL_OVERLAP of 4 in io.c.
+//#define SNR_GATE
+
 // RTC chip I2C address
 #define RTC_ADDRESS 0x68
 
+// Define if the RTC's SQW output is wired to INT0 (PD2). Its 1Hz output
+// then keeps the second tick in step while the MSF signal is lost.
+//#define RTC_SQW_INT0
+
 // Convert 8 bit quantities from 0 to 99 between
 // BCD and decimal
 #define BCD_TO_BIN(x) (((x)&0xF) + (((x)&0xF0)>>4)*10)
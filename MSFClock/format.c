@@ -0,0 +1,58 @@
+/*
+ * format.c
+ *
+ * Small formatters used instead of sprintf so that vfprintf isn't
+ * linked in. Shared by the display, the debug output and the profiler.
+ *
+ */
+
+#include "config.h"
+#include "format.h"
+
+// Writes a number from 0 to 99 as two digits with a leading zero
+char *formatTwoDigits( char *p, uint8_t value )
+{
+    uint8_t tens = 0;
+
+    while( value >= 10 )
+    {
+        value -= 10;
+        tens++;
+    }
+    *p++ = '0' + tens;
+    *p++ = '0' + value;
+
+    return p;
+}
+
+// Writes a number in decimal with no leading zeros
+char *formatDecimal( char *p, uint32_t value )
+{
+    char digits[FORMAT_DECIMAL_LEN];
+    uint8_t len = 0;
+
+    do
+    {
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    }
+    while( value );
+
+    while( len )
+    {
+        *p++ = digits[--len];
+    }
+
+    return p;
+}
+
+// Copies a string without its terminator
+char *formatText( char *p, const char *text )
+{
+    while( *text )
+    {
+        *p++ = *text++;
+    }
+
+    return p;
+}
@@ -0,0 +1,28 @@
+/*
+ * format.h
+ *
+ * Small formatters used instead of sprintf so that vfprintf isn't
+ * linked in.
+ *
+ */
+
+
+#ifndef FORMAT_H_
+#define FORMAT_H_
+
+// The most characters formatDecimal() writes
+#define FORMAT_DECIMAL_LEN 10
+
+// Each one writes at p and returns a pointer to just after what it
+// wrote. None of them terminate the string.
+
+// Writes a number from 0 to 99 as two digits with a leading zero
+char *formatTwoDigits( char *p, uint8_t value );
+
+// Writes a number in decimal with no leading zeros
+char *formatDecimal( char *p, uint32_t value );
+
+// Copies a string without its terminator
+char *formatText( char *p, const char *text );
+
+#endif /* FORMAT_H_ */
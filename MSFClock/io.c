@@ -4,47 +4,422 @@
  * Implements the Goertzel algorithm on the ADC input
  * to detect the MSF clock signal after the NE602 mixer.
  *
- * By sampling at 4 times the frequency the algorithm
- * is very simple.
+ * Sampling at around 4 times the IF the algorithm is
+ * the same as mixing down to I/Q and summing over the
+ * window, which is how it is done here. The LO is a
+ * numerically controlled oscillator so the bin can be
+ * put wherever the IF actually is. Each block has the
+ * phase of the carrier as well as its magnitude, and the
+ * change in phase from one block to the next measures
+ * how far the IF is from the middle of the bin, which
+ * the NCO then follows. The bins either side of it
+ * measure the noise for the SNR.
+ *
+ * The CPU clock sets both the LO and the sample rate so
+ * a resonator a fraction of a percent out moves the IF
+ * by hundreds of Hz, further than the bin is wide. With
+ * no stored calibration the NCO is swept across that
+ * range at startup to find the carrier, and the setting
+ * is kept in the EEPROM for the next time.
+ *
+ * The ADC free runs at F_CPU/32/13 so the ISR has 416 cycles
+ * between conversions, or 450 when timer 1 triggers it with
+ * COHERENT_ADC. Cycles per invocation including entry and
+ * exit, estimated from the instruction timings with the
+ * default settings:
+ *
+ *   Skipped sample                         ~155
+ *   Processed sample                       ~350
+ *   End of a hop, worst case               ~970
+ *
+ * Entry and exit are around 140 of each as the end of a hop
+ * needs nearly every register saved. Feeding the sample into
+ * the decimating filter is around 15, 25 for the second order
+ * CIC. A processed sample adds around 40 for the NCO's sine
+ * and cosine, 80 for multiplying by them into the hop and 40
+ * for the millisecond count. The end of a hop adds:
+ *
+ *   Sliding the window sums and saturating  ~110
+ *   Magnitude of the carrier                 ~40
+ *   Neighbouring bins for the noise         ~210
+ *   Decision against the noise floor         ~60
+ *   Noise floor minimum, end of a run       ~110
+ *   Writing the block record to the ring     ~70
+ *
+ * Within two conversions, 832 cycles, the conversion that
+ * completes during the ISR is still read afterwards. Any
+ * longer and the next one overwrites it, the hop is a
+ * conversion longer and the millisecond count falls behind.
+ * The estimate for the end of a hop is over that so it needs
+ * checking on the hardware. The PROFILE build measures the
+ * ISR without its entry and exit, and the debug output pin
+ * shows it on a scope. The first 32 bit kernel used __mulsi3
+ * and overran the end of every block.
  *
  * Created: 28/03/2021 13:15:39
  *  Author: Richard Tomlinson G4TGJ
  */ 
 
  #include <avr/interrupt.h>
+ #include <avr/eeprom.h>
+ #include <util/atomic.h>
 
  #include "config.h"
+ #include "millis.h"
+ #include "io.h"
+ #include "profile.h"
 
 // The number of samples for calculating the signal magnitude
 #define NUM_SAMPLES 28
 
-// The number of samples over which we will average the signal
-// to decide the threshold for deciding the carrier is present
+// Number of overlapping Goertzel windows. Each is NUM_SAMPLES long but
+// they are staggered so a magnitude is produced every
+// NUM_SAMPLES/GOERTZEL_OVERLAP samples, improving the timing of the
+// carrier edges without shortening the integration.
+// 1 for no overlap, 2 for 50% and 4 for 75%.
+#define GOERTZEL_OVERLAP 4
+
+// Samples between each new magnitude
+#define GOERTZEL_HOP (NUM_SAMPLES / GOERTZEL_OVERLAP)
+
+#if (GOERTZEL_HOP * GOERTZEL_OVERLAP) != NUM_SAMPLES
+#error NUM_SAMPLES must be a multiple of GOERTZEL_OVERLAP
+#endif
+
+// The neighbouring bins are worked out from the four hops in the window
+// so there is no SNR with any other overlap
+#if GOERTZEL_OVERLAP == 4
+#define NEIGHBOUR_BINS
+#endif
+
+#ifdef SNR_GATE
+#ifndef NOISE_FLOOR_DETECTOR
+#error SNR_GATE needs NOISE_FLOOR_DETECTOR
+#endif
+#ifndef NEIGHBOUR_BINS
+#error SNR_GATE needs a GOERTZEL_OVERLAP of 4
+#endif
+
+// A block is taken to be broadband interference when the bins either
+// side of the carrier are over this margin above the noise floor, in
+// eighths, and over half the carrier bin's magnitude
+#define SNR_GATE_MARGIN 16     // 2 times, 6dB
+#endif
+
+// The signal average is an exponential moving average over
+// 2^AVERAGE_SHIFT samples which is used to decide the threshold
+// for deciding the carrier is present
 // Needs to be a lot more that the number of goertzel samples
-#define NUM_AVERAGE_SAMPLES 1024
+#define AVERAGE_SHIFT 10
+
+#ifdef NOISE_FLOOR_DETECTOR
+// The noise floor is found by minimum statistics. The block magnitudes
+// are averaged over short runs of NOISE_RUN_BLOCKS, which is 38ms. The
+// smallest run average over NOISE_RUNS runs, which is 1.2s, is from a run
+// that lies within the 100ms at the start of a second where the carrier
+// is always off, whether or not the carrier is being detected. These
+// minimums are smoothed over 2^NOISE_SMOOTH_SHIFT of them.
+#define NOISE_RUN_SHIFT    4
+#define NOISE_RUN_BLOCKS   (1 << NOISE_RUN_SHIFT)
+#define NOISE_RUNS         32
+#define NOISE_SMOOTH_SHIFT 2
+
+// The carrier is detected when the magnitude goes above the on margin and
+// lost when it drops below the off margin. They are multiples of the
+// noise floor in eighths.
+#define NOISE_ON_MARGIN  20     // 2.5 times, 8dB
+#define NOISE_OFF_MARGIN 10     // 1.25 times, 2dB
+
+// The threshold for a margin over the noise floor
+#define NOISE_THRESHOLD(floor, margin) ((uint16_t) (((uint32_t) (floor) * (margin)) >> 3))
+#endif
 
-// To get the correct sample rate we only process every so
-// many samples
+// To get the correct sample rate we decimate by combining
+// every so many samples
+#ifdef COHERENT_ADC
+#define SAMPLE_COUNT 12
+#else
 #define SAMPLE_COUNT 13
+#endif
+
+// Order of the CIC decimating filter
+// 0 - only use every SAMPLE_COUNT'th sample and discard the rest
+// 1 - integrate and dump, sums all the samples
+// 2 - second order CIC, deeper nulls at the aliasing frequencies
+//     (multiples of the Goertzel sample rate) for a little more work
+#define CIC_ORDER 1
+
+// Shift to bring the decimated sample back into range so the Goertzel
+// state fits in 16 bits. A first order filter gains SAMPLE_COUNT and a
+// second order SAMPLE_COUNT squared.
+#if CIC_ORDER == 2
+#define CIC_SHIFT 4
+#else
+#define CIC_SHIFT 0
+#endif
+
+#ifdef COHERENT_ADC
+// The LO is the CPU clock divided by twice LO_HALF_CYCLES and the IF is
+// what is left of the MSF carrier. A decimated sample every
+// F_CPU / (4 * IF) cycles, rounded to the nearest cycle, puts the
+// Goertzel bin on the IF. At 16MHz and 59.3kHz the LO is 59259Hz, the
+// IF 740.7Hz and a sample every 5400 cycles is exact.
+#define MSF_FREQUENCY  60000UL
+#define LO_HALF_CYCLES (F_CPU / CLOCK_FREQUENCY / 2 + 1)
+#define IF_DIVISOR     (2 * (2 * LO_HALF_CYCLES * MSF_FREQUENCY - F_CPU))
+#define RX_TICK_CYCLES ((F_CPU * LO_HALF_CYCLES + IF_DIVISOR / 2) / IF_DIVISOR)
+
+// Timer 1 triggers a conversion every ADC_CONVERSION_CYCLES
+#define ADC_CONVERSION_CYCLES (RX_TICK_CYCLES / SAMPLE_COUNT)
+
+#if 2 * LO_HALF_CYCLES * MSF_FREQUENCY <= F_CPU
+#error The LO must be below the MSF carrier
+#endif
+#if (F_CPU * LO_HALF_CYCLES) % IF_DIVISOR
+#warning The sample rate is not exactly 4 times the IF
+#endif
+#if RX_TICK_CYCLES % SAMPLE_COUNT
+#error SAMPLE_COUNT must divide the cycles per decimated sample
+#endif
+
+// A triggered conversion takes 13.5 ADC clocks (prescaled by 32) and 3
+// cycles to synchronise. A trigger while one is running is lost.
+#if ADC_CONVERSION_CYCLES < (27 * 32 / 2 + 3)
+#error SAMPLE_COUNT is too large for the ADC to keep up
+#endif
+#else
+// CPU cycles for each ADC conversion (ADC clock prescaled by 32)
+// and for each decimated sample
+#define ADC_CONVERSION_CYCLES (13UL * 32)
+#define RX_TICK_CYCLES (ADC_CONVERSION_CYCLES * SAMPLE_COUNT)
+#endif
+
+// CPU cycles in a millisecond
+#define MS_CYCLES (F_CPU / 1000UL)
+
+// Length of a Goertzel window in ms, rounded up
+#define WINDOW_MS ((NUM_SAMPLES * RX_TICK_CYCLES + MS_CYCLES - 1) / MS_CYCLES)
+
+// How long the carrier must stay in a new state before the change is
+// accepted. Converted to a number of Goertzel decisions, rounding up.
+// A weak signal has noise dropouts of 20ms or more which would otherwise
+// look like a second marker.
+#define RX_DEBOUNCE_MS 30
+#define RX_DEBOUNCE_DECISIONS ((RX_DEBOUNCE_MS * MS_CYCLES + GOERTZEL_HOP * RX_TICK_CYCLES - 1) / (GOERTZEL_HOP * RX_TICK_CYCLES))
 
-// The square of the magnitude of the clock signal as
+// The preprocessor works these out in long arithmetic but the compiler
+// uses the types of the constants, and the products overflow a 16 bit int
+_Static_assert( sizeof( RX_TICK_CYCLES ) == sizeof( long ), "RX_TICK_CYCLES must be a long" );
+#if NUM_SAMPLES == 28 && GOERTZEL_OVERLAP == 4 && RX_DEBOUNCE_MS == 30 && F_CPU == 16000000UL
+_Static_assert( WINDOW_MS == 10, "WINDOW_MS should be 10" );
+_Static_assert( RX_DEBOUNCE_DECISIONS == 13, "RX_DEBOUNCE_DECISIONS should be 13" );
+#endif
+
+// The IF is measured from the phase change between blocks over
+// IF_TRACK_BLOCKS pairs of blocks with the carrier present, around 0.6s.
+// The products are scaled down by 2^IF_PRODUCT_SHIFT so the sums fit.
+#define IF_TRACK_BLOCKS  256
+#define IF_PRODUCT_SHIFT 8
+
+// Phase is in 1/65536ths of a turn
+#define PHASE_RADIAN 10430
+
+// The NCO's step of phase per decimated sample for a frequency in Hz
+// A quarter turn a sample is the nominal IF.
+#define NCO_STEP(hz) ((uint16_t) ((hz) * 65536ULL * RX_TICK_CYCLES / F_CPU))
+#define NCO_NOMINAL  16384U
+
+// Tenths of a Hz for each step of the NCO, scaled by 2^16
+#define IF_TENTHS_SCALE (10UL * F_CPU / RX_TICK_CYCLES)
+
+// The furthest the IF is tracked from where it was calibrated. The bin
+// is about 105Hz either side to its nulls.
+#define IF_TRACK_LIMIT_HZ 60
+#define IF_TRACK_LIMIT ((int16_t) NCO_STEP( IF_TRACK_LIMIT_HZ ))
+
+// The calibration sweep tries the NCO every CAL_STEP_HZ for CAL_STEPS
+// steps either side of the nominal IF, which covers a CPU clock that is
+// 0.5% out. Each setting is given CAL_SETTLE_BLOCKS to fill the window
+// and to flush the ring and is then tried for CAL_RUNS runs of
+// 2^CAL_RUN_SHIFT blocks, 1.2s. The largest run average is from a run
+// where the carrier was on throughout, if it is in the bin.
+#define CAL_STEP_HZ       50
+#define CAL_STEPS         7
+#define CAL_SETTLE_BLOCKS 16
+#define CAL_RUN_SHIFT     4
+#define CAL_RUNS          32
+
+// The sweep has found the carrier if the best setting's level is over
+// this margin above the worst's, in eighths
+#define CAL_MARGIN 12   // 1.5 times, 3.5dB
+
+// The sweep is run again after this many blocks without a frame being
+// decoded, around 10 minutes, in case the carrier wasn't found or the
+// stored calibration is wrong, say after the resonator was changed
+#define CAL_RETRY_BLOCKS 250000UL
+
+// The stored calibration is brought up to date once the carrier has
+// been decoded somewhere this far from it
+#define CAL_UPDATE_HZ 10
+
+// The calibration sweep isn't running
+#define CAL_IDLE 0xFF
+
+// The calibration kept in the EEPROM. check is the complement of the
+// step so erased or corrupt EEPROM isn't used.
+typedef struct
+{
+    uint16_t ncoStep;
+    uint16_t check;
+} IF_CALIBRATION;
+
+// Goertzel block records waiting for the main loop
+// Needs to cover the longest the main loop can be busy for. The display
+// and RTC are written in the background so that is now storing the IF
+// calibration in the EEPROM, around 14ms or 6 blocks.
+// Length must be a power of 2
+#define RX_BLOCK_RING_LEN 16
+
+// The estimated magnitude of the clock signal as
 // calculated by the goertzel algorithm
-static volatile uint32_t magsq;
+static volatile uint16_t magnitude;
 
-// The average signal - used to scale the threshold
-// for the clock signal
+#ifndef NOISE_FLOOR_DETECTOR
+// The average of the absolute signal scaled up by 2^AVERAGE_SHIFT
+// Used to scale the threshold for the clock signal
 static volatile uint32_t average;
+#endif
+
+// Time in ms kept by counting decimated samples. Starts at the millis()
+// time so blocks can be timestamped in the ISR on the same timebase.
+static volatile uint32_t rxTime;
+
+// A record of every Goertzel block passed from the ISR to the main loop.
+// Only the ISR writes the head and only the main loop writes the tail.
+// Both are single bytes so can be read and written without disabling
+// interrupts.
+static volatile RX_BLOCK blockRing[RX_BLOCK_RING_LEN];
+static volatile uint8_t blockHead, blockTail;
+
+// The number of blocks dropped because the ring was full
+static volatile uint16_t blockOverruns;
+
+// The longest a block has waited in the ring for the main loop in ms
+static uint16_t maxLatency;
 
-// True when the signal is present
-static volatile bool bSignal;
+#ifdef RTC_SQW_INT0
+// The time of the last falling edge of the RTC's 1Hz output
+static volatile uint32_t sqwTime;
+static volatile bool bSQWEdge;
+#endif
+
+// The NCO's phase step per decimated sample, which puts the middle of
+// the bin on the IF, and the calibrated step the tracking is limited to
+// either side of
+static volatile uint16_t ncoStep = NCO_NOMINAL;
+static uint16_t ncoCentre = NCO_NOMINAL;
+
+// The calibration as it is in the EEPROM and whether it is valid
+static IF_CALIBRATION EEMEM eeCalibration;
+static bool bCalibrated;
+
+// The setting the calibration sweep is trying, from 0 to 2 * CAL_STEPS,
+// or CAL_IDLE, and the blocks to go before it is run again unless a frame
+// is decoded
+static uint8_t calSetting = CAL_IDLE;
+static uint32_t calRetry;
+
+// A quarter of a sine wave in 64 steps a turn, scaled by 127
+static const int8_t quarterSine[17] =
+{
+    0, 12, 25, 37, 49, 60, 71, 81, 90, 98, 106, 112, 117, 122, 125, 126, 127
+};
+
+// True when the signal is present (after debouncing)
+static bool bSignal;
+
+// Average magnitude of the carrier when it is present
+static uint16_t carrierLevel;
 
+// Average magnitude of the noise in the neighbouring bins
+static uint16_t noiseLevel;
+
+#ifdef NOISE_FLOOR_DETECTOR
+// The mean magnitude of the noise, or 0 until it has been measured
+static uint16_t noiseFloor;
+#else
 // The threshold for deciding the clock signal is present
 // Also keep the previous threshold so we can apply hysteresis
-static uint32_t threshold, prevThreshold;
+static uint16_t threshold, prevThreshold;
+#endif
+
+// Reduce to 16 bits with saturation so that an overload cannot wrap
+// round and look like a strong signal
+static inline int16_t sat16( int32_t x )
+{
+    if( x > INT16_MAX )
+    {
+        return INT16_MAX;
+    }
+    else if( x < INT16_MIN )
+    {
+        return INT16_MIN;
+    }
+    return x;
+}
+
+// Sine of a phase scaled by 127
+static inline int8_t phaseSine( uint16_t phase )
+{
+    uint8_t step = phase >> 10;
+    uint8_t k = step & 15;
+    int8_t s = (step & 16) ? quarterSine[16 - k] : quarterSine[k];
+
+    return (step & 32) ? -s : s;
+}
+
+// Estimates the magnitude of a vector without a square root
+// Max + 3/8 Min is within 7% of the true value
+static inline uint16_t estimateMagnitude( int16_t x, int16_t y )
+{
+    uint16_t ax = (x < 0) ? -x : x;
+    uint16_t ay = (y < 0) ? -y : y;
+
+    if( ax < ay )
+    {
+        uint16_t t = ax;
+        ax = ay;
+        ay = t;
+    }
+
+    return ax + (ay >> 2) + (ay >> 3);
+}
 
 // A to D interrupt complete vector
  ISR (ADC_vect)
 {
+    PROFILE_START( PROFILE_ADC_ISR );
+
+#ifdef COHERENT_ADC
+    // The compare flag has to be cleared for the next match to trigger
+    // a conversion
+    TIFR1 = (1<<OCF1B);
+#endif
+
+    // Scale the sample from 8 bit unsigned to a signed number
+    int8_t adc = ADCH - 128;
+
+    // Integrate every sample into the decimating filter
+    // Unsigned so that the CIC integrators wrap around cleanly
+#if CIC_ORDER >= 1
+    static uint16_t integrator1;
+    integrator1 += adc;
+#endif
+#if CIC_ORDER >= 2
+    static uint16_t integrator2;
+    integrator2 += integrator1;
+#endif
+
     // To get the correct sample rate only process every n samples
     static uint8_t count;
     count++;
@@ -56,53 +431,252 @@ static uint32_t threshold, prevThreshold;
 DEBUG_OUTPUT_PIN_REG = (1<<DEBUG_OUTPUT_PIN);
 #endif
 
-        // The values for the goertzel algorithm
-        static int32_t q0, q1, q2;
+        // Keep the ms time up to date
+        static uint16_t rxCycles;
+        rxCycles += RX_TICK_CYCLES;
+        while( rxCycles >= MS_CYCLES )
+        {
+            rxCycles -= MS_CYCLES;
+            rxTime++;
+        }
 
-        // The number of samples we have processed for goertzel
+        // The number of samples we have processed since the last magnitude
+        // and the oldest hop in the window
         static uint8_t gCount;
+        static uint8_t window;
 
-        // Scale the sample from 8 bit unsigned to a signed number
-        int32_t sample = ((int16_t) ADCH) - 128;
+        // Dump the filter to get the decimated sample
+#if CIC_ORDER == 0
+        int16_t sample = adc;
+#elif CIC_ORDER == 1
+        int16_t sample = integrator1;
+        integrator1 = 0;
+#else
+        static uint16_t prevIntegrator2, prevComb;
+        uint16_t comb = integrator2 - prevIntegrator2;
+        int16_t sample = (int16_t) (comb - prevComb) >> CIC_SHIFT;
+        prevIntegrator2 = integrator2;
+        prevComb = comb;
+#endif
 
-        // Process the Goertzel algorithm
-        q0 = sample - q2;
-        q2 = q1;
-        q1 = q0;
+        // Mix down to I/Q with the NCO and sum over the hop. The NCO
+        // carries on from one hop to the next so the phase of the blocks
+        // can be compared.
+        static uint16_t ncoPhase;
+        static int16_t hopI, hopQ;
+        int8_t c = phaseSine( ncoPhase + 16384 );
+        int8_t s = phaseSine( ncoPhase );
+        hopI += ((int32_t) sample * c) >> 7;
+        hopQ -= ((int32_t) sample * s) >> 7;
+        ncoPhase += ncoStep;
 
-        // Keep a moving average of the signal magnitude squared
+#ifndef NOISE_FLOOR_DETECTOR
+        // Keep a moving average of the signal magnitude
         // We use this to determine the threshold
-        average = (average * (NUM_AVERAGE_SAMPLES-1)  + sample*sample) / NUM_AVERAGE_SAMPLES;
+        average += ((sample < 0) ? -sample : sample) - (average >> AVERAGE_SHIFT);
+#endif
 
-        // Check if we have processed enough samples to calculate the magnitude
+        // Check if a hop has processed enough samples to calculate the magnitude
         gCount++;
-        if( gCount == NUM_SAMPLES )
+        if( gCount == GOERTZEL_HOP )
         {
-            // Calculate the magnitude squared
-            magsq =  q1*q1 +  q2*q2;
+            int16_t i = hopI;
+            int16_t q = hopQ;
+            hopI = hopQ = 0;
+
+            // Slide the window on by a hop and calculate the magnitude
+            static int16_t ringI[GOERTZEL_OVERLAP], ringQ[GOERTZEL_OVERLAP];
+            static int32_t windowI, windowQ;
+            windowI += i - ringI[window];
+            windowQ += q - ringQ[window];
+            ringI[window] = i;
+            ringQ[window] = q;
+
+            int16_t blockI = sat16( windowI );
+            int16_t blockQ = sat16( windowQ );
+            magnitude = estimateMagnitude( blockI, blockQ );
+
+#ifdef NEIGHBOUR_BINS
+            // The bins either side of the carrier are the hops turned on
+            // by a further quarter turn each hop, one way or the other.
+            // Which hop is the oldest only turns the whole sum, which
+            // doesn't change the magnitude. Two bins away is the hops
+            // turned by a half turn each, but a hop is an odd number of
+            // samples so the mixer's image at twice the IF lands there.
+            int16_t aI = ringI[0] - ringI[2];
+            int16_t aQ = ringQ[0] - ringQ[2];
+            int16_t bI = ringI[1] - ringI[3];
+            int16_t bQ = ringQ[1] - ringQ[3];
+            uint32_t noiseSum = estimateMagnitude( sat16( (int32_t) aI + bQ ), sat16( (int32_t) aQ - bI ) );
+            noiseSum += estimateMagnitude( sat16( (int32_t) aI - bQ ), sat16( (int32_t) aQ + bI ) );
+            uint16_t blockNoise = noiseSum >> 1;
+#else
+            uint16_t blockNoise = 0;
+#endif
+
+#ifdef NOISE_FLOOR_DETECTOR
+            // The carrier has to rise above the on margin and then stays
+            // until it falls below the off margin
+            static bool carrier;
+            uint16_t decisionThreshold = NOISE_THRESHOLD( noiseFloor, carrier ? NOISE_OFF_MARGIN : NOISE_ON_MARGIN );
+
+#ifdef SNR_GATE
+            // Broadband interference, such as an impulse, raises the bins
+            // either side as much as the carrier's. The block can't be
+            // relied on so the last decision stands. An edge of the
+            // carrier spreads into them too but much less.
+            bool bClear = (blockNoise <= NOISE_THRESHOLD( noiseFloor, SNR_GATE_MARGIN )) || (blockNoise <= (magnitude >> 1));
+#else
+            bool bClear = true;
+#endif
+
+            // Nothing is detected until the noise floor has been measured
+            if( bClear )
+            {
+                carrier = noiseFloor && (magnitude > decisionThreshold);
+            }
+            if( carrier )
+            {
+                LED_OUTPUT_PORT_REG |= (1<<LED_OUTPUT_PIN);
+            }
+            else
+            {
+                LED_OUTPUT_PORT_REG &= ~(1<<LED_OUTPUT_PIN);
+            }
+
+            // Find the smallest average over a run of blocks
+            static uint32_t runSum;
+            static uint8_t runBlocks, runs;
+            static uint16_t runMin = UINT16_MAX;
+
+            runSum += magnitude;
+            runBlocks++;
+            if( runBlocks >= NOISE_RUN_BLOCKS )
+            {
+                uint16_t runAverage = runSum >> NOISE_RUN_SHIFT;
+                if( runAverage < runMin )
+                {
+                    runMin = runAverage;
+                }
+                runSum = 0;
+                runBlocks = 0;
+
+                // Smooth the minimums into the noise floor. The first
+                // is taken as it is.
+                runs++;
+                if( runs >= NOISE_RUNS )
+                {
+                    if( noiseFloor )
+                    {
+                        noiseFloor += ((int16_t) (runMin - noiseFloor)) >> NOISE_SMOOTH_SHIFT;
+                    }
+                    else
+                    {
+                        noiseFloor = runMin;
+                    }
+                    runMin = UINT16_MAX;
+                    runs = 0;
+                }
+            }
+#else
+            uint16_t decisionThreshold = threshold;
+            bool carrier;
 
             // Is the signal strong enough?
-            if( magsq > threshold )
+            if( magnitude > threshold )
             {
                 // Once the signal is detected it only needs to remain above a low threshold
-                prevThreshold = threshold = NUM_SAMPLES * average;
+                // For noise the magnitude averages about NUM_SAMPLES/5 times the
+                // average absolute sample
+                prevThreshold = threshold = (uint16_t) ((average * (NUM_SAMPLES / 4)) >> AVERAGE_SHIFT);
                 LED_OUTPUT_PORT_REG |= (1<<LED_OUTPUT_PIN);
-                bSignal = true;
+                carrier = true;
             }
             else
             {
                 // To help eliminate false signals set the threshold
                 // to be much higher than previously
-                threshold = prevThreshold * 4;
+                threshold = prevThreshold * 2;
                 LED_OUTPUT_PORT_REG &= ~(1<<LED_OUTPUT_PIN);
-                bSignal = false;
+                carrier = false;
+            }
+#endif
+
+            // Pass the block on to the main loop unless it has fallen behind
+            uint8_t head = blockHead;
+            uint8_t next = (head + 1) & (RX_BLOCK_RING_LEN - 1);
+            if( next != blockTail )
+            {
+                blockRing[head].time = rxTime;
+                blockRing[head].magnitude = magnitude;
+                blockRing[head].threshold = decisionThreshold;
+                blockRing[head].carrier = carrier;
+                blockRing[head].i = blockI;
+                blockRing[head].q = blockQ;
+                blockRing[head].noise = blockNoise;
+                blockHead = next;
+            }
+            else
+            {
+                blockOverruns++;
             }
 
-            // Restart the Goertzel algorithm
+            // Start the next hop
             gCount = 0;
-            q1 = q2 = 0;
+            window++;
+            if( window >= GOERTZEL_OVERLAP )
+            {
+                window = 0;
+            }
         }
     }
+
+    PROFILE_END( PROFILE_ADC_ISR );
+}
+
+#ifdef RTC_SQW_INT0
+// External interrupt 0 is the RTC's 1Hz output
+// Timestamp the edge on the same timebase as the blocks
+ISR (INT0_vect)
+{
+    sqwTime = rxTime;
+    bSQWEdge = true;
+}
+#endif
+
+// Sets the NCO step the ISR mixes with
+// Leaves interrupts as they were as ioInit() calls it before they are on
+static void setNCOStep( uint16_t step )
+{
+    ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+    {
+        ncoStep = step;
+    }
+}
+
+// The NCO step for a setting of the calibration sweep
+static uint16_t calStep( uint8_t setting )
+{
+    return NCO_NOMINAL - CAL_STEPS * NCO_STEP( CAL_STEP_HZ ) + setting * NCO_STEP( CAL_STEP_HZ );
+}
+
+// Stores the IF calibration in the EEPROM
+// Only the bytes that have changed are written
+static void storeCalibration( uint16_t step )
+{
+    IF_CALIBRATION cal;
+    cal.ncoStep = step;
+    cal.check = ~step;
+    eeprom_update_block( &cal, &eeCalibration, sizeof(cal) );
+    bCalibrated = true;
+}
+
+// Starts the calibration sweep from the lowest setting
+static void startCalibration( void )
+{
+    calSetting = 0;
+    calRetry = 0;
+    setNCOStep( calStep( 0 ) );
 }
 
 void ioInit()
@@ -116,6 +690,11 @@ void ioInit()
     DEBUG_OUTPUT_DDR_REG |= (1<<DEBUG_OUTPUT_PIN);
 #endif
 
+#ifdef COHERENT_ADC
+    // Hold the timers while they are set up so that they start in step
+    GTCCR = (1<<TSM) | (1<<PSRSYNC);
+#endif
+
     // Setup timer 0 to produce RX clock
     // This is the LO for the NE602
 #ifdef DDRD
@@ -128,6 +707,37 @@ void ioInit()
     OCR0A = (F_CPU / CLOCK_FREQUENCY / 2);
     TCCR0A |= (1<<COM0A0);
 
+#ifdef COHERENT_ADC
+    // Timer 1 triggers the ADC from the same clock as the LO
+    // CTC mode with OCR1A as the top and no prescaler. Compare match B
+    // starts each conversion.
+    TCCR1A = 0;
+    TCCR1B = (1<<WGM12) | (1<<CS10);
+    OCR1A = ADC_CONVERSION_CYCLES - 1;
+    OCR1B = 0;
+    TCNT0 = 0;
+    TCNT1 = 0;
+#endif
+
+    // Edges are timestamped on the millis() timebase
+    rxTime = millis();
+
+    // Use the stored IF calibration if there is one, otherwise sweep for
+    // the carrier. The ADC interrupt isn't running yet.
+    IF_CALIBRATION cal;
+    eeprom_read_block( &cal, &eeCalibration, sizeof(cal) );
+    uint16_t check = ~cal.ncoStep;
+    if( cal.check == check && cal.ncoStep < 2 * NCO_NOMINAL )
+    {
+        ncoStep = ncoCentre = cal.ncoStep;
+        bCalibrated = true;
+        calRetry = CAL_RETRY_BLOCKS;
+    }
+    else
+    {
+        startCalibration();
+    }
+
     // Set up the ADC
     // Use AVCC as voltage reference and left adjust result (for 8 bit samples)
     ADMUX = (1<<REFS0) | (1<<ADLAR);
@@ -135,18 +745,415 @@ void ioInit()
     // Disable the digital circuitry on the pin
     DIDR0 = (1<<ADC0D);
 
+#ifdef COHERENT_ADC
+    // Enable the ADC, trigger on timer 1 compare match B, enable completion interrupt,
+    // prescale by 32
+    ADCSRB = (1<<ADTS2) | (0<<ADTS1) | (1<<ADTS0);
+    ADCSRA = (1<<ADEN) | (1<<ADATE) | (1<<ADIE) | (1<<ADPS2) | (0<<ADPS1) | (1<<ADPS0);
+
+    // Start the timers
+    GTCCR = 0;
+#else
     // Enable the ADC, start conversion, enable auto triggering, enable completion interrupt,
     // prescale by 32
     ADCSRA = (1<<ADEN) | (1<<ADSC) | (1<<ADATE) | (1<<ADIE) | (1<<ADPS2) | (0<<ADPS1) | (1<<ADPS0);
+#endif
 
     // Turn on the pull-ups on unused pins
     PORTC = (1<<PORTC1) | (1<<PORTC2) | (1<<PORTC3) | (1<<PORTC4) | (1<<PORTC5);
     PORTD = (1<<PORTD0) | (1<<PORTD1) | (1<<PORTD2) | (1<<PORTD3) | (1<<PORTD7);
+
+#ifdef RTC_SQW_INT0
+    // The RTC's 1Hz output is open drain on INT0 (PD2) so relies on the
+    // pull-up above. Interrupt on the falling edge.
+    EICRA = (1<<ISC01);
+    EIMSK = (1<<INT0);
+#endif
+}
+
+// Works through the calibration sweep a block at a time, measuring the
+// carrier level at each setting of the NCO. Settles on the best setting
+// if it clearly stands out from the rest and stores it.
+static void calibrate( const RX_BLOCK *block )
+{
+    static uint8_t settle, runBlocks, runs;
+    static uint32_t runSum;
+    static uint16_t level, bestLevel, worstLevel;
+    static uint8_t best;
+
+    // Let the window fill with the new setting
+    if( settle < CAL_SETTLE_BLOCKS )
+    {
+        settle++;
+        return;
+    }
+
+    // Keep the largest run average for this setting
+    runSum += block->magnitude;
+    runBlocks++;
+    if( runBlocks < (1 << CAL_RUN_SHIFT) )
+    {
+        return;
+    }
+    if( (runSum >> CAL_RUN_SHIFT) > level )
+    {
+        level = runSum >> CAL_RUN_SHIFT;
+    }
+    runSum = 0;
+    runBlocks = 0;
+
+    runs++;
+    if( runs < CAL_RUNS )
+    {
+        return;
+    }
+    runs = 0;
+    settle = 0;
+
+    if( calSetting == 0 || level > bestLevel )
+    {
+        bestLevel = level;
+        best = calSetting;
+    }
+    if( calSetting == 0 || level < worstLevel )
+    {
+        worstLevel = level;
+    }
+    level = 0;
+
+    // Move on to the next setting
+    calSetting++;
+    if( calSetting <= 2 * CAL_STEPS )
+    {
+        setNCOStep( calStep( calSetting ) );
+        return;
+    }
+
+    // The sweep is finished. Without a clear carrier go back to where the
+    // NCO was. Either way try again later if nothing is decoded.
+    if( bestLevel > (((uint32_t) worstLevel * CAL_MARGIN) >> 3) )
+    {
+        ncoCentre = calStep( best );
+        storeCalibration( ncoCentre );
+    }
+    calRetry = CAL_RETRY_BLOCKS;
+    setNCOStep( ncoCentre );
+    calSetting = CAL_IDLE;
+}
+
+// Measures the IF from how far the phase moves on from one block to the
+// next while the carrier is present. The blocks are a hop apart and have
+// already been mixed down by the last estimate so what is left is the
+// error in it. The windows overlap so the noise they share biases the
+// angle towards zero on a weak signal, which only slows the tracking.
+static void measureIF( const RX_BLOCK *block )
+{
+    static int16_t prevI, prevQ;
+    static bool prevCarrier;
+    static int32_t cross, dot;
+    static uint16_t blocks;
+
+    if( block->carrier && prevCarrier )
+    {
+        // The phase change is the angle of this block times the
+        // conjugate of the last
+        cross += ((int32_t) block->q * prevI - (int32_t) block->i * prevQ) >> IF_PRODUCT_SHIFT;
+        dot += ((int32_t) block->i * prevI + (int32_t) block->q * prevQ) >> IF_PRODUCT_SHIFT;
+        blocks++;
+    }
+    prevI = block->i;
+    prevQ = block->q;
+    prevCarrier = block->carrier;
+
+    if( blocks >= IF_TRACK_BLOCKS )
+    {
+        // Anything over a quarter turn is too far out of the bin to be
+        // the carrier
+        if( dot > 0 )
+        {
+            // Bring them into range for working out the angle
+            while( dot > INT16_MAX || cross > INT16_MAX || cross < -INT16_MAX )
+            {
+                dot >>= 1;
+                cross >>= 1;
+            }
+
+            // For a small angle cross/dot is the angle in radians. Limit
+            // it to a radian, which is around 65Hz, and let the next
+            // measurements catch up with anything more.
+            if( cross > dot )
+            {
+                cross = dot;
+            }
+            else if( cross < -dot )
+            {
+                cross = -dot;
+            }
+            // The NCO steps once a sample rather than once a hop
+            int16_t step = cross * PHASE_RADIAN / dot / GOERTZEL_HOP;
+
+            int16_t offset = (int16_t) (ncoStep - ncoCentre) + step / 2;
+            if( offset > IF_TRACK_LIMIT )
+            {
+                offset = IF_TRACK_LIMIT;
+            }
+            else if( offset < -IF_TRACK_LIMIT )
+            {
+                offset = -IF_TRACK_LIMIT;
+            }
+
+            setNCOStep( ncoCentre + offset );
+        }
+
+        cross = 0;
+        dot = 0;
+        blocks = 0;
+    }
+}
+
+// Get the next Goertzel block record from the ISR
+// Returns false if there are none waiting
+bool ioGetRXBlock( RX_BLOCK *block )
+{
+    uint8_t tail = blockTail;
+
+    if( tail == blockHead )
+    {
+        return false;
+    }
+
+    block->time = blockRing[tail].time;
+    block->magnitude = blockRing[tail].magnitude;
+    block->threshold = blockRing[tail].threshold;
+    block->carrier = blockRing[tail].carrier;
+    block->i = blockRing[tail].i;
+    block->q = blockRing[tail].q;
+    block->noise = blockRing[tail].noise;
+
+    // Only free up the slot once we have finished with it
+    blockTail = (tail + 1) & (RX_BLOCK_RING_LEN - 1);
+
+    if( calSetting != CAL_IDLE )
+    {
+        // Nothing is received while the sweep is moving the bin about
+        calibrate( block );
+        block->carrier = false;
+    }
+    else
+    {
+        measureIF( block );
+
+        if( calRetry && --calRetry == 0 )
+        {
+            startCalibration();
+        }
+    }
+
+    // Smooth the noise in the neighbouring bins for the SNR. A window
+    // with a carrier edge in it spreads into them so the noise is only
+    // taken once the carrier has been steady for a whole window.
+    static bool prevCarrier;
+    static uint8_t steadyBlocks;
+    if( block->carrier != prevCarrier )
+    {
+        prevCarrier = block->carrier;
+        steadyBlocks = 0;
+    }
+    else if( steadyBlocks < GOERTZEL_OVERLAP )
+    {
+        steadyBlocks++;
+    }
+    else
+    {
+        noiseLevel += (int16_t) (block->noise - noiseLevel) >> 4;
+    }
+
+    // Note how long the block was waiting for the main loop
+    uint32_t now;
+    do
+    {
+        now = rxTime;
+    }
+    while( now != rxTime );
+
+    if( (now - block->time) > maxLatency )
+    {
+        maxLatency = now - block->time;
+    }
+
+    return true;
+}
+
+// Returns true if there is a block record waiting for the main loop
+bool ioRXBlockReady()
+{
+    return blockTail != blockHead;
+}
+
+// Get the longest time in ms a block record has waited for the main loop
+uint16_t ioGetRXLatency()
+{
+    return maxLatency;
+}
+
+// Get the number of blocks dropped because the main loop fell behind
+uint16_t ioGetRXOverruns()
+{
+    uint16_t overruns;
+
+    // Read twice in case the ISR changes it half way through
+    do
+    {
+        overruns = blockOverruns;
+    }
+    while( overruns != blockOverruns );
+
+    return overruns;
+}
+
+// Get the IF measured from the carrier in tenths of a Hz
+uint16_t ioGetIFFrequency()
+{
+    return ((uint32_t) ncoStep * IF_TENTHS_SCALE) >> 16;
+}
+
+// Stores the IF the carrier is being tracked at as the calibration if
+// there isn't one or it has moved too far from it. Call when the carrier
+// has been decoded so it is known to be the carrier being tracked.
+void ioSaveIFCalibration()
+{
+    if( calSetting != CAL_IDLE )
+    {
+        return;
+    }
+    calRetry = CAL_RETRY_BLOCKS;
+
+    uint16_t step = ncoStep;
+    int16_t moved = step - ncoCentre;
+    if( !bCalibrated || moved > (int16_t) NCO_STEP( CAL_UPDATE_HZ ) || moved < -(int16_t) NCO_STEP( CAL_UPDATE_HZ ) )
+    {
+        ncoCentre = step;
+        storeCalibration( step );
+    }
+}
+
+// Get the SNR in dB of the carrier against the noise in the neighbouring bins
+// Returns 0 until the noise has been measured, or always without the bins
+uint8_t ioGetSNR()
+{
+    // Count the 1dB steps up from the noise. A step is 10^(1/20), which
+    // is 287/256. Scaled up so that the steps are not lost to rounding.
+    uint32_t level = (uint32_t) noiseLevel << 4;
+    uint32_t carrier = (uint32_t) carrierLevel << 4;
+    uint8_t snr = 0;
+
+    if( level == 0 )
+    {
+        return 0;
+    }
+
+    while( (level * 287 >> 8) <= carrier && snr < 99 )
+    {
+        level = level * 287 >> 8;
+        snr++;
+    }
+
+    return snr;
+}
+
+// Works out how long after a carrier edge the Goertzel decision crossed
+// the threshold. The magnitude ramps up (or down) over a window as
+// the carrier fills it, so the delay is the fraction of the window the
+// carrier needs to fill (or empty) to cross the threshold.
+static uint16_t edgeDelay( bool level, uint16_t edgeThreshold )
+{
+    // Fraction of the window scaled by 256
+    uint16_t fraction = 256;
+    if( edgeThreshold < carrierLevel )
+    {
+        fraction = ((uint32_t) edgeThreshold << 8) / carrierLevel;
+    }
+
+    if( !level )
+    {
+        fraction = 256 - fraction;
+    }
+
+    return ((uint32_t) NUM_SAMPLES * RX_TICK_CYCLES * fraction / 256) / MS_CYCLES;
+}
+
+// Debounce the carrier decisions from the ISR
+// Returns true if the block completes a carrier edge, in which case level
+// is true if the carrier came on and time is the millis() time the edge
+// happened, allowing for the detection and debounce delays
+bool ioFindRXEdge( const RX_BLOCK *block, bool *level, uint32_t *time )
+{
+    // The latest carrier decision, the time it last changed and
+    // the threshold that it crossed at the time
+    static bool carrier;
+    static uint32_t changeTime;
+    static uint16_t changeThreshold;
+
+    // The number of decisions the carrier has been in its new state
+    static uint8_t stableCount;
+
+    bool bEdge = false;
+
+    if( block->carrier )
+    {
+        // Track the carrier level for working out the edge delay
+        carrierLevel += (int16_t) (block->magnitude - carrierLevel) >> 3;
+    }
+
+    if( block->carrier != carrier )
+    {
+        carrier = block->carrier;
+        changeTime = block->time;
+        changeThreshold = block->threshold;
+        stableCount = 0;
+    }
+
+    // Only accept the carrier change once it has been stable for long
+    // enough but timestamp it with the first decision in the new state
+    if( carrier != bSignal )
+    {
+        stableCount++;
+        if( stableCount >= RX_DEBOUNCE_DECISIONS )
+        {
+            bSignal = carrier;
+            *level = carrier;
+            *time = changeTime - edgeDelay( carrier, changeThreshold );
+            bEdge = true;
+        }
+    }
+
+    return bEdge;
 }
 
-// Read the RX input signal
-// true means the carrier is present
-bool ioReadRXInput()
+// Get the length of the Goertzel window each block covers in ms
+uint8_t ioGetRXWindowMS()
 {
-    return bSignal;
+    return WINDOW_MS;
 }
+
+#ifdef RTC_SQW_INT0
+// Get the time of the last falling edge of the RTC's 1Hz output
+// Returns false if there hasn't been one since the last call
+bool ioGetRTCSecond( uint32_t *time )
+{
+    if( !bSQWEdge )
+    {
+        return false;
+    }
+    bSQWEdge = false;
+
+    // Read twice in case the ISR changes it half way through
+    do
+    {
+        *time = sqwTime;
+    }
+    while( *time != sqwTime );
+
+    return true;
+}
+#endif
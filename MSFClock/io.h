@@ -9,10 +9,52 @@
 #ifndef IO_H_
 #define IO_H_
 
+// A record of each Goertzel block passed from the ADC interrupt to the
+// main loop
+typedef struct
+{
+    uint32_t time;          // millis() time at the end of the block
+    uint16_t magnitude;     // Estimated magnitude of the carrier
+    uint16_t threshold;     // Threshold the magnitude was compared with
+    bool     carrier;       // true if the magnitude was over the threshold
+    int16_t  i, q;          // The carrier as I/Q, its phase carries on from block to block
+    uint16_t noise;         // Mean magnitude in the neighbouring bins
+} RX_BLOCK;
+
 // Initialise all IO ports
 void ioInit();
 
-// Read the RX input signal
-bool ioReadRXInput();
+// Get the next Goertzel block record from the ADC interrupt
+bool ioGetRXBlock( RX_BLOCK *block );
+
+// Returns true if a block record is waiting
+bool ioRXBlockReady();
+
+// Get the longest time in ms a block record has waited for the main loop
+uint16_t ioGetRXLatency();
+
+// Get the number of block records dropped because the main loop fell behind
+uint16_t ioGetRXOverruns();
+
+// Debounce a block record and return true if it completes a carrier edge
+bool ioFindRXEdge( const RX_BLOCK *block, bool *level, uint32_t *time );
+
+// Get the length of the Goertzel window each block covers in ms
+uint8_t ioGetRXWindowMS();
+
+// Get the IF measured from the carrier in tenths of a Hz
+uint16_t ioGetIFFrequency();
+
+// Store the IF the carrier is being tracked at for the next startup
+// Call when a frame has been decoded
+void ioSaveIFCalibration();
+
+// Get the SNR in dB of the carrier against the noise in the neighbouring bins
+uint8_t ioGetSNR();
+
+#ifdef RTC_SQW_INT0
+// Get the time of the last falling edge of the RTC's 1Hz output
+bool ioGetRTCSecond( uint32_t *time );
+#endif
 
 #endif /* IO_H_ */
\ No newline at end of file
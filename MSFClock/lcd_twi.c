@@ -0,0 +1,74 @@
+/*
+ * lcd_twi.c
+ *
+ * Writes to the LCD through its PCF8574 I2C backpack using the TWI
+ * queue so that updating the display doesn't hold up the main loop.
+ *
+ * The LCD is in 4 bit mode so each byte is sent as two nibbles, each
+ * strobed with the enable line, which is four writes to the PCF8574.
+ * These are collected and queued as one transaction for every few
+ * characters. At 100kHz each write takes 90us which is longer than
+ * the enable pulse or a character write needs.
+ *
+ * If the TWI queue is full the writes are held back and the caller is
+ * told so it can try them again with the next update.
+ *
+ */
+
+#include <stddef.h>
+
+#include "config.h"
+#include "twi.h"
+#include "lcd_twi.h"
+
+// Writes to the PCF8574 waiting to be queued
+static uint8_t lcdBuf[TWI_DATA_LEN];
+static uint8_t lcdLen;
+
+// Sends a byte as two nibbles with the RS line set for data or clear
+// for a command
+// Returns false if there is no room for it
+static bool lcdTWIWrite( uint8_t value, uint8_t rs )
+{
+    if( lcdLen > TWI_DATA_LEN - 4 && !lcdTWIFlush() )
+    {
+        return false;
+    }
+
+    uint8_t high = (value & 0xF0) | rs | LCD_TWI_BACKLIGHT;
+    uint8_t low = (value << 4) | rs | LCD_TWI_BACKLIGHT;
+
+    // The LCD reads the nibble as the enable line falls
+    lcdBuf[lcdLen++] = high | LCD_TWI_ENABLE;
+    lcdBuf[lcdLen++] = high;
+    lcdBuf[lcdLen++] = low | LCD_TWI_ENABLE;
+    lcdBuf[lcdLen++] = low;
+    return true;
+}
+
+// Move the cursor to column x on line y
+bool lcdTWICursor( uint8_t x, uint8_t y )
+{
+    return lcdTWIWrite( LCD_TWI_SET_ADDRESS | (y ? LCD_TWI_LINE_2 : 0) | x, 0 );
+}
+
+// Write a character at the cursor which then moves on
+bool lcdTWIWriteChar( char c )
+{
+    return lcdTWIWrite( c, LCD_TWI_RS );
+}
+
+// Queue anything not yet sent
+// Returns false if the TWI queue is full, leaving it to be sent later
+bool lcdTWIFlush( void )
+{
+    if( lcdLen )
+    {
+        if( !twiQueueWrite( LCD_I2C_ADDRESS, lcdBuf, lcdLen, NULL ) )
+        {
+            return false;
+        }
+        lcdLen = 0;
+    }
+    return true;
+}
@@ -0,0 +1,36 @@
+/*
+ * lcd_twi.h
+ *
+ * Writes to the LCD through its PCF8574 I2C backpack using the TWI
+ * queue. The display is initialised by the TARL display driver.
+ *
+ */
+
+
+#ifndef LCD_TWI_H_
+#define LCD_TWI_H_
+
+// PCF8574 port bits on the backpack
+// The LCD's D4 to D7 are on P4 to P7
+#define LCD_TWI_RS        0x01
+#define LCD_TWI_ENABLE    0x04
+#define LCD_TWI_BACKLIGHT 0x08
+
+// HD44780 command to set the display RAM address
+// The second line starts at 0x40
+#define LCD_TWI_SET_ADDRESS 0x80
+#define LCD_TWI_LINE_2      0x40
+
+// Move the cursor to column x on line y
+// Returns false if the TWI queue is full
+bool lcdTWICursor( uint8_t x, uint8_t y );
+
+// Write a character at the cursor which then moves on
+// Returns false if the TWI queue is full
+bool lcdTWIWriteChar( char c );
+
+// Queue anything not yet sent
+// Returns false if the TWI queue is full
+bool lcdTWIFlush( void );
+
+#endif /* LCD_TWI_H_ */
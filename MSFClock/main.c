@@ -8,15 +8,24 @@
  */ 
 
 #include <avr/io.h>
-#include <stdio.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <string.h>
 
 #include "config.h"
 #include "millis.h"
 #include "io.h"
 #include "display.h"
 #include "i2c.h"
+#include "twi.h"
+#include "format.h"
+#include "profile.h"
 
-#ifdef DEBUG
+#ifdef LCD_I2C
+#include "lcd_twi.h"
+#endif
+
+#if defined(DEBUG) || defined(PROFILE)
 #include "serial.h"
 #endif
 
@@ -50,6 +59,11 @@
 #define TIME_PARITY_END     51
 #define TIME_PARITY         57
 
+// DUT1 is sent in unary in B1-B8 if positive and B9-B16 if negative
+#define DUT1_POS_END         8
+#define DUT1_NEG_END        16
+#define DUT1_LEN             8
+
 enum
 {
     SUNDAY = 0,
@@ -116,9 +130,37 @@ const uint8_t daysInMonth[NUM_MONTHS+1] =
 // starting at 1
 #define NUM_BITS 62
 
-// Store the A and B bits received from MSF
-static bool bitA[NUM_BITS];
-static bool bitB[NUM_BITS];
+#if NUM_BITS > 64
+#error The MSF bits must fit in a 64 bit word
+#endif
+
+// Store the A and B bits received from MSF packed into 64 bit words
+// Bit n of the frame is held in bit 63-n so that the BCD fields, which
+// are sent most significant bit first, can be extracted with a shift
+static uint64_t bitsA, bitsB;
+
+// The time and date decoded from an MSF frame
+typedef struct
+{
+    uint8_t year, month, date, day, hour, minute;
+    int8_t  dut1;
+    bool    bDaylightSavings;
+} MSF_TIME;
+
+// The number of recent frames kept for voting on the bits when a frame
+// doesn't decode by itself, and the fewest that can be voted on
+#define FRAME_HISTORY   5
+#define FRAME_VOTE_MIN  3
+
+// The recent frames, newest first, and the millisecond count when
+// each one was received
+static uint64_t historyA[FRAME_HISTORY], historyB[FRAME_HISTORY];
+static uint32_t historyTime[FRAME_HISTORY];
+static uint8_t historyCount;
+
+// The mask for bit n of a frame and for bits start to end inclusive
+#define FRAME_BIT(n)            ((uint64_t) 1 << (63 - (n)))
+#define FRAME_MASK(start, end)  ((~(uint64_t) 0 >> (start)) & (~(uint64_t) 0 << (63 - (end))))
 
 // Buffer used for debug and display
 static char buf[50];
@@ -141,10 +183,110 @@ static uint8_t utcHour;
 // The current data bit position we are receiving from MSF
 static uint8_t currentBit;
 
-// The AVR millisecond count for the last second
-// Use to see if we have missed an MSF second and so need to
-// autonomously increment the time
-static uint32_t lastSecond;
+// The soft slicer works out the bits from the Goertzel magnitudes
+// The windows for the A and B bits in ms from the start of the second,
+// and the part of the second when the carrier is always on
+#define SLICE_A_START       100
+#define SLICE_B_START       200
+#define SLICE_B_END         300
+#define SLICE_MARKER_END    500
+#define SLICE_ON_START      550
+#define SLICE_ON_END        950
+
+// Allowance at the edges of the windows for errors in the second timing
+#define SLICE_MARGIN          5
+
+// The carrier on and off levels are averaged over 2^SLICE_LEVEL_SHIFT seconds
+#define SLICE_LEVEL_SHIFT     3
+
+// Soft values for the carrier over part of a second go from -SOFT_MAX for
+// definitely on to SOFT_MAX for definitely off
+#define SOFT_MAX            127
+
+// The minute marker is found by correlating the A bits of the last
+// MARKER_LEN seconds with MARKER_PATTERN, lsb last. This is the minute
+// identifier 01111110 in A bits 52-59 followed by the marker second whose
+// carrier is off for its first 500ms. The rest of the marker second is
+// also off, with the part after the B bit being twice as long as a bit.
+#define MARKER_PATTERN      0x0FD
+#define MARKER_LEN              9
+#define MARKER_REST_WEIGHT      3
+
+// How well the minute marker must match, out of MARKER_SCORE_MAX
+#define MARKER_SCORE_MAX    ((MARKER_LEN + MARKER_REST_WEIGHT) * SOFT_MAX)
+#define MARKER_THRESHOLD    (MARKER_SCORE_MAX / 2)
+
+// The soft values of the A bits for the last MARKER_LEN seconds
+static int8_t markerSoftA[MARKER_LEN];
+
+// Confidence in each received bit, from 0 for a guess to CONFIDENCE_MAX
+#define CONFIDENCE_MAX      255
+static uint8_t confidenceA[NUM_BITS], confidenceB[NUM_BITS];
+
+// The start of the second being sliced and the bit it is for
+static uint32_t sliceStart;
+static uint8_t sliceBit;
+
+// The magnitudes summed over the A and B windows so far, over the rest
+// of the minute marker and over the parts of the second when the carrier
+// is always off and on
+static int32_t sliceSumA, sliceSumB, sliceSumMarker, sliceSumOff, sliceSumOn;
+static uint8_t sliceCountA, sliceCountB, sliceCountMarker, sliceCountOff, sliceCountOn;
+
+// True once the bits for the second have been worked out and once it has
+// been checked for the minute marker
+static bool bSliceDone = true, bMarkerDone = true;
+
+// Average magnitude with the carrier off and on
+static int32_t sliceOffLevel, sliceOnLevel;
+
+// The local second tick is counted on the block timebase, which comes from
+// the ADC conversions, so it carries on when the signal is lost. It is
+// phase locked to the MSF second markers and the loop learns how far the
+// AVR clock is out, so it stays close to MSF until the signal comes back.
+// Tick times are in ms with a TICK_FRACTION_BITS fraction.
+#define TICK_FRACTION_BITS     16
+#define TICK_PERIOD_NOMINAL    ((int32_t) 1000 << TICK_FRACTION_BITS)
+
+// Second markers further than this from the tick are not used for locking
+#define TICK_WINDOW_MS         50
+
+// The number of markers in a row inside the window before the tick
+// is locked to them
+#define TICK_LOCK_COUNT         4
+
+// Once locked the number of markers in a row that agree with each other
+// but not with the tick before the tick is moved onto them. Stops noise
+// on a lost signal moving the tick.
+#define TICK_RELOCK_COUNT       5
+
+// Loop gains. The phase error is corrected by 1/TICK_PHASE_DIV each
+// second. The period is corrected by 1/2^shift of the error with the shift
+// going from TICK_FREQ_SHIFT_MIN to TICK_FREQ_SHIFT_MAX the longer the
+// tick is locked, so it learns the AVR clock quickly and then
+// averages out the jitter on the markers.
+#define TICK_PHASE_DIV          8
+#define TICK_FREQ_SHIFT_MIN     6
+#define TICK_FREQ_SHIFT_MAX    14
+
+// The most the period is allowed to be corrected by, 1%
+#define TICK_PERIOD_MAX_ERROR  (TICK_PERIOD_NOMINAL / 100)
+
+// The next tick, the last one and the current period
+static uint32_t tickTime;
+static uint16_t tickFraction;
+static uint32_t lastTick;
+static int32_t tickPeriod = TICK_PERIOD_NOMINAL;
+
+// Lock state
+static bool bTickLocked;
+static uint8_t tickLockCount;
+static uint8_t tickFreqShift = TICK_FREQ_SHIFT_MIN;
+static uint16_t tickFreqCount;
+
+// Markers that don't agree with the tick while it's locked
+static int16_t tickCandidate;
+static uint8_t tickCandidateCount;
 
 // The millisecond count for the last second pulse receive from MSF
 // Used to display if second pulses are being received
@@ -154,6 +296,22 @@ static uint32_t lastSecondPulse;
 // Used to display if we are getting minute pulses
 static uint32_t lastMinute;
 
+// True when the RTC is to be written at the next second tick
+static bool bWriteRTC;
+
+// True once the RTC has been read since the signal was lost
+static bool bReadRTC;
+
+#ifdef RTC_SQW_INT0
+// How far the edges of the RTC's 1Hz output are from the second tick in ms,
+// scaled by 2^SQW_OFFSET_SHIFT. Learnt while the tick is locked to MSF
+// so the edges can keep the tick in step with MSF while the signal is
+// lost.
+#define SQW_OFFSET_SHIFT 3
+static int16_t sqwOffset;
+static bool bSQWOffset;
+#endif
+
 // Do we have a good signal, are we receiving second and minute pulses?
 static bool bGoodSignal, bGoodSecond, bGoodMinute;
 
@@ -161,45 +319,38 @@ static bool bGoodSignal, bGoodSecond, bGoodMinute;
 static int8_t dut1;
 
 static void convertTimeUTC(void);
+static void sliceFinish( void );
 
 // Initialise the RTC chip
 static void initRTC(void)
 {
-    // Disable the 32kHz and 1Hz outputs
+    // Disable the 32kHz output
     i2cWriteRegister(RTC_ADDRESS, RTC_REG_STATUS, 0);
+
+#ifdef RTC_SQW_INT0
+    // Enable the 1Hz square wave output
+    i2cWriteRegister(RTC_ADDRESS, RTC_REG_CONTROL, 0);
+#else
+    // Disable the 1Hz output
     i2cWriteRegister(RTC_ADDRESS, RTC_REG_CONTROL, 1<<RTC_CONTROL_INTCN);
+#endif
 }
 
-// Read the time from the RTC chip
-static void readRTCTime(void)
+// Number of RTC time registers, seconds to year
+#define RTC_TIME_LEN (RTC_REG_YEAR - RTC_REG_SECONDS + 1)
+
+// Called when the RTC time has been read
+static void rtcTimeRead( uint8_t result, const uint8_t *regs )
 {
-    if( i2cReadRegister(RTC_ADDRESS, RTC_REG_SECONDS, &currentSecond) == 0 )
-    {
-        currentSecond = BCD_TO_BIN( currentSecond );
-    }
-    if( i2cReadRegister(RTC_ADDRESS, RTC_REG_MINUTES, &currentMinute) == 0 )
-    {
-        currentMinute = BCD_TO_BIN( currentMinute );
-    }
-    if( i2cReadRegister(RTC_ADDRESS, RTC_REG_HOURS, &currentHour) == 0 )
-    {
-        currentHour = BCD_TO_BIN( currentHour );
-    }
-    if( i2cReadRegister(RTC_ADDRESS, RTC_REG_DAY, &currentDay) == 0 )
-    {
-        currentDay--; // MSF has days as 0-6 but RTC is 1-7
-    }
-    if( i2cReadRegister(RTC_ADDRESS, RTC_REG_DATE, &currentDate) == 0 )
-    {
-        currentDate = BCD_TO_BIN( currentDate );
-    }
-    if( i2cReadRegister(RTC_ADDRESS, RTC_REG_MONTH, &currentMonth) == 0 )
-    {
-        currentMonth = BCD_TO_BIN( currentMonth );
-    }
-    if( i2cReadRegister(RTC_ADDRESS, RTC_REG_YEAR, &currentYear) == 0 )
+    if( result == 0 )
     {
-        currentYear = BCD_TO_BIN( currentYear );
+        currentSecond = BCD_TO_BIN( regs[RTC_REG_SECONDS] );
+        currentMinute = BCD_TO_BIN( regs[RTC_REG_MINUTES] );
+        currentHour = BCD_TO_BIN( regs[RTC_REG_HOURS] );
+        currentDay = regs[RTC_REG_DAY] - 1; // MSF has days as 0-6 but RTC is 1-7
+        currentDate = BCD_TO_BIN( regs[RTC_REG_DATE] );
+        currentMonth = BCD_TO_BIN( regs[RTC_REG_MONTH] );
+        currentYear = BCD_TO_BIN( regs[RTC_REG_YEAR] );
     }
 
     // Nowhere to store the daylight saving setting in the RTC so
@@ -210,23 +361,94 @@ static void readRTCTime(void)
     convertTimeUTC();
 }
 
+// Read the time from the RTC chip
+// All the time registers are read in one go so they are consistent.
+// The read is queued and the time is set by rtcTimeRead() when it is done.
+// Returns false if the TWI queue is full.
+static bool readRTCTime(void)
+{
+    PROFILE_START( PROFILE_RTC_I2C );
+    bool bQueued = twiQueueReadRegisters(RTC_ADDRESS, RTC_REG_SECONDS, RTC_TIME_LEN, rtcTimeRead);
+    PROFILE_END( PROFILE_RTC_I2C );
+
+    return bQueued;
+}
+
 // Write the UTC time to the RTC chip
-// We do this every minute
-static void writeRTCTime(void)
+// We do this every minute at a local second tick. Writing the seconds
+// restarts the RTC's count to the next second so this keeps its seconds
+// in step with MSF.
+// Returns false if the TWI queue is full.
+static bool writeRTCTime(void)
+{
+    uint8_t regs[RTC_TIME_LEN];
+
+    regs[RTC_REG_SECONDS] = BIN_TO_BCD(currentSecond);
+    regs[RTC_REG_MINUTES] = BIN_TO_BCD(currentMinute);
+    regs[RTC_REG_HOURS] = BIN_TO_BCD(utcHour);
+    regs[RTC_REG_DAY] = utcDay+1;  // MSF has days as 0-6 but RTC is 1-7
+    regs[RTC_REG_DATE] = BIN_TO_BCD(utcDate);
+    regs[RTC_REG_MONTH] = BIN_TO_BCD(utcMonth);
+    regs[RTC_REG_YEAR] = BIN_TO_BCD(utcYear);
+
+    PROFILE_START( PROFILE_RTC_I2C );
+    bool bQueued = twiQueueWriteRegisters(RTC_ADDRESS, RTC_REG_SECONDS, regs, RTC_TIME_LEN, NULL);
+    PROFILE_END( PROFILE_RTC_I2C );
+
+#ifdef RTC_SQW_INT0
+    // The square wave has moved so has to be measured again
+    if( bQueued )
+    {
+        bSQWOffset = false;
+    }
+#endif
+
+    return bQueued;
+}
+
+// Gets bit n of a frame
+static inline bool getFrameBit( uint64_t bits, uint8_t n )
+{
+    return (bits & FRAME_BIT(n)) != 0;
+}
+
+// Sets bit n of a frame to a value
+static inline void setFrameBit( uint64_t *bits, uint8_t n, bool value )
+{
+    if( value )
+    {
+        *bits |= FRAME_BIT(n);
+    }
+    else
+    {
+        *bits &= ~FRAME_BIT(n);
+    }
+}
+
+// Writes the two characters at the end of the time line. With a good
+// signal this is DUT1 as a sign and a digit, otherwise it is whether minute
+// and second markers are being received, in capitals if they are.
+static char *formatDUT1( char *p )
 {
-    i2cWriteRegister(RTC_ADDRESS, RTC_REG_SECONDS, BIN_TO_BCD(currentSecond));
-    i2cWriteRegister(RTC_ADDRESS, RTC_REG_MINUTES, BIN_TO_BCD(currentMinute));
-    i2cWriteRegister(RTC_ADDRESS, RTC_REG_HOURS, BIN_TO_BCD(utcHour));
-    i2cWriteRegister(RTC_ADDRESS, RTC_REG_DAY, utcDay+1);  // MSF has days as 0-6 but RTC is 1-7
-    i2cWriteRegister(RTC_ADDRESS, RTC_REG_DATE, BIN_TO_BCD(utcDate));
-    i2cWriteRegister(RTC_ADDRESS, RTC_REG_MONTH, BIN_TO_BCD(utcMonth));
-    i2cWriteRegister(RTC_ADDRESS, RTC_REG_YEAR, BIN_TO_BCD(utcYear));
+    if( bGoodSignal )
+    {
+        *p++ = (dut1 >= 0) ? '+' : '-';
+        *p++ = '0' + ((dut1 >= 0) ? dut1 : -dut1);
+    }
+    else
+    {
+        *p++ = bGoodMinute ? 'M' : 'm';
+        *p++ = bGoodSecond ? 'S' : 's';
+    }
+
+    return p;
 }
 
 #ifdef DEBUG
-static void displayBits( uint8_t *bits )
+static void displayBits( uint64_t bits )
 {
     uint8_t i;
+    char *p;
     for( i = 0 ; i < NUM_BITS ; i++ )
     {
         switch(i)
@@ -238,14 +460,19 @@ static void displayBits( uint8_t *bits )
             case 39:
             case 45:
             case 52:
-                sprintf( buf, " %d: ", i );
+                buf[0] = ' ';
+                p = formatDecimal( &buf[1], i );
+                *p++ = ':';
+                *p++ = ' ';
+                *p = '\0';
                 serialTXString(buf);
                 break;
 
             default:
                 break;
         }
-        sprintf( buf, "%d", bits[i] );
+        buf[0] = getFrameBit( bits, i ) ? '1' : '0';
+        buf[1] = '\0';
         serialTXString(buf);
     }
     serialTXString( "\r\n" );
@@ -255,22 +482,18 @@ static void badData( char *text )
 {
     serialTXString(text);
     serialTXString("A: ");
-    displayBits( bitA );
+    displayBits( bitsA );
     serialTXString("B: ");
-    displayBits( bitB );
+    displayBits( bitsB );
 }
 #endif
 
 // Checks the parity of a set of MSF bits
 static bool checkParity( uint8_t start, uint8_t finish, uint8_t parity )
 {
-    uint8_t count = 0;
+    uint8_t count = __builtin_popcountll( bitsA & FRAME_MASK(start, finish) );
 
-    for( uint8_t i = start ; i <= finish ; i++ )
-    {
-        count += bitA[i];
-    }
-    count += bitB[parity];
+    count += getFrameBit( bitsB, parity );
 
     // Parity is OK if the count of bits is odd
     return count & 1;
@@ -279,46 +502,28 @@ static bool checkParity( uint8_t start, uint8_t finish, uint8_t parity )
 // Converts a BCD number as received from MSF into binary
 static uint8_t convertBCD( uint8_t start, uint8_t len )
 {
-    uint8_t val = 0;
-
-#define NUM_BCD_DIGITS 8
-    static const uint8_t bcdDigit[NUM_BCD_DIGITS] = {80, 40, 20, 10, 8, 4, 2, 1};
-
-    uint8_t digit = NUM_BCD_DIGITS - len;
-
-    for( uint8_t i = start ; i < (start + len) ; i++ )
-    {
-        val += (bitA[i] * bcdDigit[digit++]);
-    }
+    // The least significant bit of the field is at start+len-1
+    uint8_t bcd = (bitsA >> (64 - start - len)) & ((1 << len) - 1);
 
-    return val;
+    return BCD_TO_BIN( bcd );
 }
 
 // Checks that the minute identifier within the MSF data is correct
 static bool checkMinuteIdentifier()
 {
-    bool bId =  !bitA[52]
-             &&  bitA[53]
-             &&  bitA[54]
-             &&  bitA[55]
-             &&  bitA[56]
-             &&  bitA[57]
-             &&  bitA[58]
-             && !bitA[59];
+    // Bits 52 to 59 must be 01111110
+    bool bId = (bitsA & FRAME_MASK(52, 59)) == FRAME_MASK(53, 58);
 
 #ifdef DEBUG
     if( !bId )
     {
-        sprintf(buf, "ID: %d%d%d%d%d%d%d%d\n\r", 
-            bitA[52],
-            bitA[53],
-            bitA[54],
-            bitA[55],
-            bitA[56],
-            bitA[57],
-            bitA[58],
-            bitA[59]
-        );
+        char *p = formatText( buf, "ID: " );
+        for( uint8_t i = 52 ; i <= 59 ; i++ )
+        {
+            *p++ = getFrameBit( bitsA, i ) ? '1' : '0';
+        }
+        p = formatText( p, "\n\r" );
+        *p = '\0';
         serialTXString(buf);
     }
 #endif
@@ -326,6 +531,31 @@ static bool checkMinuteIdentifier()
     return bId;
 }
 
+// Decodes one half of the DUT1 code which ends at bit end of B
+// The n bits from the start must be set for a DUT1 of n with no others set
+// Returns false if the bits do not make a valid code
+static bool decodeDUT1( uint8_t end, int8_t *value )
+{
+    // The valid patterns for each number of bits set. The first bit is
+    // the most significant.
+    static const uint8_t dut1Pattern[DUT1_LEN + 1] =
+    {
+        0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE, 0xFF
+    };
+
+    uint8_t bits = bitsB >> (63 - end);
+    uint8_t count = __builtin_popcount( bits );
+
+    *value = 0;
+    if( bits != dut1Pattern[count] )
+    {
+        return false;
+    }
+
+    *value = count;
+    return true;
+}
+
 // Converts an MSF day number into text
 static const char *convertDay( uint8_t day )
 {
@@ -425,458 +655,638 @@ static void convertTimeUTC(void)
     }
 }
 
+// What is showing on the LCD so that only the changed characters are sent
+static char lcdShadow[LCD_HEIGHT][LCD_WIDTH];
+
+// Update a line of the display, clearing the rest of the line after
+// the text
+// Each run of changed characters is sent as a cursor move followed by
+// the characters as the LCD moves the cursor on after each one.
+// The I2C LCD is written through the TWI queue so the update carries
+// on in the background. If the queue is full the characters that didn't
+// fit are left different from the shadow so the next update sends them.
+static void updateDisplayLine( uint8_t line, const char *text )
+{
+    bool bCursor = false;
+
+    for( uint8_t col = 0 ; col < LCD_WIDTH ; col++ )
+    {
+        char c = *text ? *text++ : ' ';
+
+        if( c == lcdShadow[line][col] )
+        {
+            bCursor = false;
+        }
+        else
+        {
+#ifdef LCD_I2C
+            if( !bCursor )
+            {
+                bCursor = lcdTWICursor( col, line );
+            }
+            if( !bCursor || !lcdTWIWriteChar( c ) )
+            {
+                bCursor = false;
+                continue;
+            }
+#else
+            if( !bCursor )
+            {
+                displayCursor( col, line );
+                bCursor = true;
+            }
+            displayWriteChar( c );
+#endif
+            lcdShadow[line][col] = c;
+        }
+    }
+
+#ifdef LCD_I2C
+    lcdTWIFlush();
+#endif
+}
+
 // Displays the time
 static void displayTime(void)
 {
+    char *p;
+
 #ifdef DEBUG
-    sprintf( buf, "%s %u/%u/%u %02u:%02u:%02u UTC %s\r\n", convertDay(utcDay), utcDate, utcMonth, utcYear, utcHour, currentMinute, currentSecond, bGoodSignal ? "OK" : "Lost" );
+    p = formatText( buf, convertDay(utcDay) );
+    *p++ = ' ';
+    p = formatDecimal( p, utcDate );
+    *p++ = '/';
+    p = formatDecimal( p, utcMonth );
+    *p++ = '/';
+    p = formatDecimal( p, utcYear );
+    *p++ = ' ';
+    p = formatTwoDigits( p, utcHour );
+    *p++ = ':';
+    p = formatTwoDigits( p, currentMinute );
+    *p++ = ':';
+    p = formatTwoDigits( p, currentSecond );
+    p = formatText( p, bGoodSignal ? " UTC OK\r\n" : " UTC Lost\r\n" );
+    *p = '\0';
     //serialTXString( buf );
 #endif
 
 #if 0
     static uint32_t secondCount;
     secondCount++;
-    sprintf( buf, "%lu", secondCount );
+    p = formatDecimal( buf, secondCount );
+    *p = '\0';
 #else
-    sprintf( buf, "%s %02u/%02u/%02u   %c", convertDay(utcDay), utcDate, utcMonth, utcYear, bGoodSignal ? '*' : ' ' );
+    p = formatText( buf, convertDay(utcDay) );
+    *p++ = ' ';
+    p = formatTwoDigits( p, utcDate );
+    *p++ = '/';
+    p = formatTwoDigits( p, utcMonth );
+    *p++ = '/';
+    p = formatTwoDigits( p, utcYear );
+    p = formatText( p, "   " );
+    *p++ = bGoodSignal ? '*' : ' ';
+    *p = '\0';
 #endif
-    displayText(0, buf, true);
-    sprintf( buf, "%02u:%02u:%02u UTC  %c%c", utcHour, currentMinute, currentSecond, bGoodSignal ? (dut1 >= 0 ? '+' : '-') : bGoodMinute ?  'M' : 'm', bGoodSignal ? (dut1 >= 0 ? dut1 + '0' : '0' - dut1) : bGoodSecond ? 'S' : 's');
-    displayText(1, buf, true);
+    updateDisplayLine(0, buf);
+
+    p = formatTwoDigits( buf, utcHour );
+    *p++ = ':';
+    p = formatTwoDigits( p, currentMinute );
+    *p++ = ':';
+    p = formatTwoDigits( p, currentSecond );
+    p = formatText( p, " UTC  " );
+    p = formatDUT1( p );
+    *p = '\0';
+    updateDisplayLine(1, buf);
 }
 
-// Process the data received from MSF over the last minute
-static void processRXData(void)
+// Reads the date and time fields of the frame in bitsA whatever their
+// parity, for bringing a frame up to date before it is voted on
+static void readFrameTime( MSF_TIME *time )
+{
+    time->year = convertBCD(YEAR_START, YEAR_LEN);
+    time->month = convertBCD(MONTH_START, MONTH_LEN);
+    time->date = convertBCD(DATE_START, DATE_LEN);
+    time->day = convertBCD(DAY_START, DAY_LEN);
+    time->hour = convertBCD(HOUR_START, HOUR_LEN);
+    time->minute = convertBCD(MINUTE_START, MINUTE_LEN);
+    time->dut1 = 0;
+    time->bDaylightSavings = false;
+}
+
+// Decodes the frame in bitsA and bitsB into a time
+// Returns true if all the parity checks are OK and the data is sensible.
+// Needed because the checks are not very sophisticated and won't detect
+// all errors.
+static bool decodeFrame( MSF_TIME *time )
 {
-    // We will read the data in but only set the values if all the
-    // parity checks are OK and the data is sensible. Needed because
-    // the checks are not very sophisticated and won't detect all
-    // errors.
-    uint8_t year = 0, month = 1, date = 1, day = 1, hour = 0, minute = 0, second = 0;
+    bool bGood = true;
 
     // For processing the DUT1 value
-    uint8_t posDutCount;
     int8_t posDut1 = 0;
-    uint8_t negDutCount;
     int8_t negDut1 = 0;
 
-    // If the minute identifier is wrong then the data isn't valid
-    if( checkMinuteIdentifier() )
+    // Check the parities and if they are good read in the data
+    // Check the data is sensible before setting the current value
+    if( checkParity(YEAR_START, YEAR_START + YEAR_LEN - 1, YEAR_PARITY) )
     {
-        // The signal is good unless we find any parity errors
-        bGoodSignal = true;
-        currentSecond = 0;
-
-        // Check the parities and if they are good read in the data
-        // Check the data is sensible before setting the current value
-        if( checkParity(YEAR_START, YEAR_START + YEAR_LEN - 1, YEAR_PARITY) )
+        time->year = convertBCD(YEAR_START, YEAR_LEN);
+        if( time->year > 99 )
         {
-            year = convertBCD(YEAR_START, YEAR_LEN);
-            if( year > 99 )
-            {
-                bGoodSignal = false;
+            bGood = false;
 #ifdef DEBUG
-                badData("Bad year\r\n");
+            badData("Bad year\r\n");
 #endif
-            }
         }
-        else
-        {
-            bGoodSignal = false;
+    }
+    else
+    {
+        bGood = false;
 #ifdef DEBUG
-            badData("Bad year parity\r\n");
+        badData("Bad year parity\r\n");
 #endif
-        }
+    }
 
-        if( checkParity(MONTH_PARITY_START, MONTH_PARITY_END, MONTH_PARITY) )
+    if( checkParity(MONTH_PARITY_START, MONTH_PARITY_END, MONTH_PARITY) )
+    {
+        time->month = convertBCD(MONTH_START, MONTH_LEN);
+        if( time->month < JANUARY || time->month > DECEMBER )
         {
-            month = convertBCD(MONTH_START, MONTH_LEN);
-            if( month < JANUARY || month > DECEMBER )
-            {
-                bGoodSignal = false;
+            bGood = false;
 #ifdef DEBUG
-                badData("Bad month\r\n");
+            badData("Bad month\r\n");
 #endif
-            }
+        }
 
-            date = convertBCD(DATE_START, DATE_LEN);
-            if( date < 1 || date > getDaysInMonth(currentMonth, currentYear) )
-            {
-                bGoodSignal = false;
+        time->date = convertBCD(DATE_START, DATE_LEN);
+        if( time->date < 1 || time->date > getDaysInMonth(time->month, time->year) )
+        {
+            bGood = false;
 #ifdef DEBUG
-                badData("Bad date\r\n");
+            badData("Bad date\r\n");
 #endif
-            }
         }
-        else
-        {
-            bGoodSignal = false;
+    }
+    else
+    {
+        bGood = false;
 #ifdef DEBUG
-            badData("Bad date parity\r\n");
+        badData("Bad date parity\r\n");
 #endif
-        }
+    }
 
-        if( checkParity(DAY_START, DAY_START + DAY_LEN - 1, DAY_PARITY) )
+    if( checkParity(DAY_START, DAY_START + DAY_LEN - 1, DAY_PARITY) )
+    {
+        time->day = convertBCD(DAY_START, DAY_LEN);
+        if( time->day > LAST_DAY )
         {
-            day = convertBCD(DAY_START, DAY_LEN);
-            if( day > LAST_DAY )
-            {
-                bGoodSignal = false;
+            bGood = false;
 #ifdef DEBUG
-                badData("Bad day\r\n");
+            badData("Bad day\r\n");
 #endif
-            }
         }
-        else
+    }
+    else
+    {
+        bGood = false;
+#ifdef DEBUG
+        badData("Bad day parity\r\n");
+#endif
+    }
+
+    if( checkParity(TIME_PARITY_START, TIME_PARITY_END, TIME_PARITY) )
+    {
+        time->hour = convertBCD(HOUR_START, HOUR_LEN);
+        if( time->hour > 23 )
         {
-            bGoodSignal = false;
+            bGood = false;
 #ifdef DEBUG
-            badData("Bad day parity\r\n");
+            badData("Bad hour\r\n");
 #endif
         }
 
-        if( checkParity(TIME_PARITY_START, TIME_PARITY_END, TIME_PARITY) )
+        time->minute = convertBCD(MINUTE_START, MINUTE_LEN);
+        if( time->minute > 59 )
         {
-            hour = convertBCD(HOUR_START, HOUR_LEN);
-            if( hour > 23 )
-            {
-                bGoodSignal = false;
+            bGood = false;
 #ifdef DEBUG
-                badData("Bad hour\r\n");
+            badData("Bad minute\r\n");
 #endif
-            }
+        }
 
-            minute = convertBCD(MINUTE_START, MINUTE_LEN);
-            if( minute > 59 )
-            {
-                bGoodSignal = false;
+        // Process the DUT1 code
+        // Start with the positive bits then the negative bits
+        if( !decodeDUT1( DUT1_POS_END, &posDut1 ) )
+        {
+            bGood = false;
 #ifdef DEBUG
-                badData("Bad minute\r\n");
+            badData("Bad dut +\r\n");
 #endif
-            }
-
-            // Process the DUT1 code
-            dut1 = 0;
+        }
 
-            // Start by counting the positive bits. Then check that if bit n is set there are n bits set.
-            posDutCount = bitB[1] + bitB[2] + bitB[3] + bitB[4] + bitB[5] + bitB[6] + bitB[7] + bitB[8];
-            posDut1 = 0;
-            if( bitB[8] )
-            {
-                if( posDutCount == 8 )
-                {
-                    posDut1 = 8;
-                }
-                else
-                {
-                    bGoodSignal = false;
+        if( decodeDUT1( DUT1_NEG_END, &negDut1 ) )
+        {
+            negDut1 = -negDut1;
+        }
+        else
+        {
+            bGood = false;
 #ifdef DEBUG
-                    badData("Bad dut 8\r\n");
+            badData("Bad dut -\r\n");
 #endif
-                }
-            }
-            else if( bitB[7] )
-            {
-                if( posDutCount == 7 )
-                {
-                    posDut1 = 7;
-                }
-                else
-                {
-                    bGoodSignal = false;
+        }
+    }
+    else
+    {
+        bGood = false;
 #ifdef DEBUG
-                    badData("Bad dut 7\r\n");
+        badData("Bad time parity\r\n");
 #endif
-                }
-            }
-            else if( bitB[6] )
-            {
-                if( posDutCount == 6 )
-                {
-                    posDut1 = 6;
-                }
-                else
-                {
-                    bGoodSignal = false;
+    }
+
+    // Cannot have both positive and negative DUT1 signals
+    if( posDut1 && negDut1 )
+    {
+        bGood = false;
 #ifdef DEBUG
-                    badData("Bad dut 6\r\n");
+        badData("Bad dut pos/neg\r\n");
 #endif
-                }
-            }
-            else if( bitB[5] )
+    }
+    time->dut1 = posDut1 ? posDut1 : negDut1;
+
+    // The daylight savings bit is not protected in any way
+    time->bDaylightSavings = getFrameBit( bitsB, 58 );
+
+    return bGood;
+}
+
+// Moves a received time on by a minute
+static void addMinute( MSF_TIME *time )
+{
+    if( time->minute >= 59 )
+    {
+        time->minute = 0;
+        if( time->hour >= 23 )
+        {
+            time->hour = 0;
+            if( time->date >= getDaysInMonth(time->month, time->year) )
             {
-                if( posDutCount == 5 )
+                time->date = 1;
+                if( time->month >= 12 )
                 {
-                    posDut1 = 5;
+                    time->month = 1;
+                    time->year = (time->year + 1) % 100;
                 }
                 else
                 {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut 5\r\n");
-#endif
+                    time->month++;
                 }
             }
-            else if( bitB[4] )
+            else
             {
-                if( posDutCount == 4 )
-                {
-                    posDut1 = 4;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut 4\r\n");
-#endif
-                }
+                time->date++;
             }
-            else if( bitB[3] )
+            time->day = (time->day + 1) % NUM_DAYS;
+        }
+        else
+        {
+            time->hour++;
+        }
+    }
+    else
+    {
+        time->minute++;
+    }
+}
+
+// Writes a value into bitsA as MSF's most significant bit first BCD
+static void encodeBCD( uint8_t start, uint8_t len, uint8_t value )
+{
+    uint8_t shift = 64 - start - len;
+    uint64_t mask = (((uint64_t) 1 << len) - 1) << shift;
+
+    bitsA = (bitsA & ~mask) | (((uint64_t) BIN_TO_BCD(value) << shift) & mask);
+}
+
+// Sets a parity bit in bitsB so that it plus the A bits has odd parity
+static void encodeParity( uint8_t start, uint8_t finish, uint8_t parity )
+{
+    setFrameBit( &bitsB, parity, !(__builtin_popcountll( bitsA & FRAME_MASK(start, finish) ) & 1) );
+}
+
+// Encodes a time into the date and time fields of bitsA and sets the
+// parity bits to match
+static void encodeFrame( const MSF_TIME *time )
+{
+    encodeBCD( YEAR_START, YEAR_LEN, time->year );
+    encodeBCD( MONTH_START, MONTH_LEN, time->month );
+    encodeBCD( DATE_START, DATE_LEN, time->date );
+    encodeBCD( DAY_START, DAY_LEN, time->day );
+    encodeBCD( HOUR_START, HOUR_LEN, time->hour );
+    encodeBCD( MINUTE_START, MINUTE_LEN, time->minute );
+
+    encodeParity( YEAR_START, YEAR_START + YEAR_LEN - 1, YEAR_PARITY );
+    encodeParity( MONTH_PARITY_START, MONTH_PARITY_END, MONTH_PARITY );
+    encodeParity( DAY_START, DAY_START + DAY_LEN - 1, DAY_PARITY );
+    encodeParity( TIME_PARITY_START, TIME_PARITY_END, TIME_PARITY );
+}
+
+// Returns true if two received times are the same
+static bool sameTime( const MSF_TIME *a, const MSF_TIME *b )
+{
+    return a->year == b->year && a->month == b->month && a->date == b->date &&
+           a->day == b->day && a->hour == b->hour && a->minute == b->minute;
+}
+
+// Adds the frame in bitsA and bitsB to the history
+static void addFrameHistory( uint32_t time )
+{
+    for( uint8_t i = FRAME_HISTORY - 1 ; i > 0 ; i-- )
+    {
+        historyA[i] = historyA[i - 1];
+        historyB[i] = historyB[i - 1];
+        historyTime[i] = historyTime[i - 1];
+    }
+    historyA[0] = bitsA;
+    historyB[0] = bitsB;
+    historyTime[0] = time;
+
+    if( historyCount < FRAME_HISTORY )
+    {
+        historyCount++;
+    }
+}
+
+// Builds a frame in bitsA and bitsB by voting on each bit across the
+// frames in the history. The older frames are brought up to date first by
+// decoding them, adding the minutes since they were received and
+// encoding them again.
+// Returns false if there are not enough frames to vote on.
+static bool voteFrames( uint32_t time )
+{
+    uint64_t alignedA[FRAME_HISTORY], alignedB[FRAME_HISTORY];
+    uint8_t numAligned = 0;
+
+    for( uint8_t i = 0 ; i < historyCount ; i++ )
+    {
+        // The number of whole minutes since the frame was received
+        uint16_t age = (time - historyTime[i] + 30000) / 60000;
+
+        bitsA = historyA[i];
+        bitsB = historyB[i];
+
+        if( age > 0 )
+        {
+            // Frames that are too garbled to decode can't be aligned. Only
+            // the ranges matter as the parity is set again after aligning,
+            // so every field is read even if its parity fails.
+            MSF_TIME frameTime;
+            readFrameTime( &frameTime );
+            if( frameTime.year > 99 || frameTime.month < JANUARY || frameTime.month > DECEMBER ||
+                frameTime.date < 1 || frameTime.date > getDaysInMonth(frameTime.month, frameTime.year) ||
+                frameTime.day > LAST_DAY || frameTime.hour > 23 || frameTime.minute > 59 )
             {
-                if( posDutCount == 3 )
-                {
-                    posDut1 = 3;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut 3\r\n");
-#endif
-                }
+                continue;
             }
-            else if( bitB[2] )
+
+            while( age-- )
             {
-                if( posDutCount == 2 )
-                {
-                    posDut1 = 2;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut 2\r\n");
-#endif
-                }
-            }
-            else if( bitB[1] )
-            {
-                if( posDutCount == 1 )
-                {
-                    posDut1 = 1;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut 1\r\n");
-#endif
-                }
+                addMinute( &frameTime );
             }
+            encodeFrame( &frameTime );
+        }
 
-            // Now count the negative bits. Then check that if bit n is set there are n bits set.
-            negDutCount = bitB[9] + bitB[10] + bitB[11] + bitB[12] + bitB[13] + bitB[14] + bitB[15] + bitB[16];
-            negDut1 = 0;
-            if( bitB[16] )
-            {
-                if( negDutCount == 8 )
-                {
-                    negDut1 = -8;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut -8\r\n");
+        alignedA[numAligned] = bitsA;
+        alignedB[numAligned] = bitsB;
+        numAligned++;
+    }
+
+    // Need an odd number of frames so there is always a majority
+    // Drop the oldest one if necessary
+    if( (numAligned & 1) == 0 )
+    {
+        numAligned--;
+    }
+    if( numAligned < FRAME_VOTE_MIN )
+    {
+        return false;
+    }
+
+    bitsA = bitsB = 0;
+    for( uint8_t bit = 0 ; bit < NUM_BITS ; bit++ )
+    {
+        uint8_t countA = 0, countB = 0;
+        for( uint8_t i = 0 ; i < numAligned ; i++ )
+        {
+            countA += getFrameBit( alignedA[i], bit );
+            countB += getFrameBit( alignedB[i], bit );
+        }
+        setFrameBit( &bitsA, bit, countA > numAligned / 2 );
+        setFrameBit( &bitsB, bit, countB > numAligned / 2 );
+    }
+
+    return true;
+}
+
+// Tries to repair a frame that fails just one of the parity checks by
+// flipping the least confident of the bits covered by that check
+// Returns true if a bit was flipped
+static bool repairFrame( void )
+{
+    static const struct
+    {
+        uint8_t start, finish, parity;
+    } check[] =
+    {
+        { YEAR_START, YEAR_START + YEAR_LEN - 1, YEAR_PARITY },
+        { MONTH_PARITY_START, MONTH_PARITY_END, MONTH_PARITY },
+        { DAY_START, DAY_START + DAY_LEN - 1, DAY_PARITY },
+        { TIME_PARITY_START, TIME_PARITY_END, TIME_PARITY },
+    };
+
+    uint8_t failed = 0;
+    uint8_t numFailed = 0;
+    for( uint8_t i = 0 ; i < sizeof(check) / sizeof(check[0]) ; i++ )
+    {
+        if( !checkParity( check[i].start, check[i].finish, check[i].parity ) )
+        {
+            failed = i;
+            numFailed++;
+        }
+    }
+
+    if( numFailed != 1 )
+    {
+        return false;
+    }
+
+    // Start with the parity bit itself then look for a less confident A bit
+    uint8_t bit = check[failed].parity;
+    uint8_t confidence = confidenceB[bit];
+    bool bFlipA = false;
+    for( uint8_t i = check[failed].start ; i <= check[failed].finish ; i++ )
+    {
+        if( confidenceA[i] < confidence )
+        {
+            bit = i;
+            confidence = confidenceA[i];
+            bFlipA = true;
+        }
+    }
+
+    if( bFlipA )
+    {
+        bitsA ^= FRAME_BIT(bit);
+    }
+    else
+    {
+        bitsB ^= FRAME_BIT(bit);
+    }
+
+    return true;
+}
+
+#ifdef RX_FRAME_HOOK
+// Lets the host simulation see each frame as it was received, before
+// it is repaired or voted on, to measure the bit error rate
+void RX_FRAME_HOOK( uint64_t a, uint64_t b );
 #endif
-                }
-            }
-            else if( bitB[15] )
-            {
-                if( negDutCount == 7 )
-                {
-                    negDut1 = -7;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut -7\r\n");
+
+// Process the data received from MSF over the last minute
+static void processRXData( uint32_t currentTime )
+{
+    // The time we expect the next frame to have, worked out from the
+    // last frame that was decoded or voted on
+    static MSF_TIME predicted;
+    static bool bPredicted;
+
+    MSF_TIME time;
+
+#ifdef RX_FRAME_HOOK
+    RX_FRAME_HOOK( bitsA, bitsB );
 #endif
-                }
-            }
-            else if( bitB[14] )
-            {
-                if( negDutCount == 6 )
-                {
-                    negDut1 = -6;
-                }
-                else
-                {
-                    bGoodSignal = false;
+
 #ifdef DEBUG
-                    badData("Bad dut -6\r\n");
+    // How well the minute was received
+    uint16_t ifTenths = ioGetIFFrequency();
+    char *p = formatText( buf, "SNR " );
+    p = formatDecimal( p, ioGetSNR() );
+    p = formatText( p, "dB IF " );
+    p = formatDecimal( p, ifTenths / 10 );
+    *p++ = '.';
+    *p++ = '0' + ifTenths % 10;
+    p = formatText( p, "Hz\r\n" );
+    *p = '\0';
+    serialTXString( buf );
 #endif
-                }
-            }
-            else if( bitB[13] )
+
+    // If the minute identifier is wrong then the data isn't valid
+    // and the bits are probably not aligned with the seconds either
+    bGoodSignal = false;
+    if( checkMinuteIdentifier() )
+    {
+        currentSecond = 0;
+        addFrameHistory( currentTime );
+
+        // If the frame doesn't decode by itself try repairing it, then
+        // voting on it with the previous frames. Either of these could give
+        // the wrong time so they are only trusted if they give the time we
+        // were expecting.
+        bool bDecoded = decodeFrame( &time );
+        bGoodSignal = bDecoded;
+
+        if( !bGoodSignal && repairFrame() && decodeFrame( &time ) )
+        {
+            bGoodSignal = bPredicted && sameTime( &time, &predicted );
+            if( bGoodSignal )
             {
-                if( negDutCount == 5 )
-                {
-                    negDut1 = -5;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut -5\r\n");
-#endif
-                }
+                // Keep the repaired frame for voting on later
+                historyA[0] = bitsA;
+                historyB[0] = bitsB;
             }
-            else if( bitB[12] )
-            {
-                if( negDutCount == 4 )
-                {
-                    negDut1 = -4;
-                }
-                else
-                {
-                    bGoodSignal = false;
 #ifdef DEBUG
-                    badData("Bad dut -4\r\n");
+            badData( bGoodSignal ? "Repaired frame\r\n" : "Repaired frame not as predicted\r\n" );
 #endif
-                }
-            }
-            else if( bitB[11] )
-            {
-                if( negDutCount == 3 )
-                {
-                    negDut1 = -3;
-                }
-                else
-                {
-                    bGoodSignal = false;
+        }
+
+        if( !bGoodSignal && voteFrames( currentTime ) && decodeFrame( &time ) )
+        {
+            bDecoded = true;
+            bGoodSignal = bPredicted && sameTime( &time, &predicted );
 #ifdef DEBUG
-                    badData("Bad dut -3\r\n");
-#endif
-                }
-            }
-            else if( bitB[10] )
+            if( !bGoodSignal )
             {
-                if( negDutCount == 2 )
-                {
-                    negDut1 = -2;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut -2\r\n");
-#endif
-                }
+                badData("Voted frame not as predicted\r\n");
             }
-            else if( bitB[9] )
-            {
-                if( negDutCount == 1 )
-                {
-                    negDut1 = -1;
-                }
-                else
-                {
-                    bGoodSignal = false;
-#ifdef DEBUG
-                    badData("Bad dut -1\r\n");
 #endif
-                }
-            }
-
         }
-        else
+
+        // A repaired frame that wasn't expected isn't used for the next
+        // prediction as it is most likely wrong. A voted frame is, so that
+        // two votes in a row that agree can get a lock.
+        if( bDecoded || bGoodSignal )
         {
-            bGoodSignal = false;
-#ifdef DEBUG
-            badData("Bad time parity\r\n");
-#endif
+            predicted = time;
+            bPredicted = true;
         }
     }
+#ifdef DEBUG
     else
     {
-        bGoodSignal = false;
-#ifdef DEBUG
         badData("Bad minute marker\r\n");
-#endif
     }
+#endif
 
-    // If everything received OK then can update the DUT
-    if( bGoodSignal )
+    // The next frame should be a minute on
+    if( bPredicted )
     {
-        // Cannot have both positive and negative DUT1 signals
-        if( posDut1)
-        {
-            if( negDut1 )
-            {
-                bGoodSignal = false;
-#ifdef DEBUG
-                badData("Bad dut pos/neg\r\n");
-#endif
-            }
-            else
-            {
-                dut1 = posDut1;
-            }
-        }
-        else
-        {
-            dut1 = negDut1;
-        }
+        addMinute( &predicted );
     }
 
     // If everything received OK then can update the time
     if( bGoodSignal )
     {
-        currentYear = year;
-        currentMonth = month;
-        currentDate = date;
-        currentDay = day;
-        currentHour = hour;
-        currentMinute = minute;
-        currentSecond = second;
-
-        // The daylight savings bit is not protected in any way
-        bDaylightSavings = bitB[58];
+        currentYear = time.year;
+        currentMonth = time.month;
+        currentDate = time.date;
+        currentDay = time.day;
+        currentHour = time.hour;
+        currentMinute = time.minute;
+        currentSecond = 0;
+        dut1 = time.dut1;
+        bDaylightSavings = time.bDaylightSavings;
 
         // Convert the received time to UTC if necessary
         convertTimeUTC();
 
-        // Write to the RTC chip
-        writeRTCTime();
+        // Write to the RTC chip at the next second tick
+        bWriteRTC = true;
+
+        // The IF the frame was received at is good for the next startup
+        ioSaveIFCalibration();
     }
 
     // Start the next minute with all the bits zeroed
+    bitsA = bitsB = 0;
     for( uint8_t i = 0 ; i < NUM_BITS ; i++ )
     {
-        bitA[i] = bitB[i] = 0;
+        confidenceA[i] = confidenceB[i] = 0;
     }
 }
 
-// Called every second either because we have an MSF second tick or because we
-// have missed one (so that the clock keeps going without a signal)
-static void newSecond( uint32_t currentTime )
+// Called every local second tick
+static void newSecond( void )
 {
 #ifdef DEBUG
-    sprintf( buf, "\r\nSecond %u MSF bit %u ", currentSecond, currentBit );
-    //serialTXString(buf);
-#endif
-
-#ifdef DEBUG
-    sprintf( buf, "\r\ncurrentTime %lu  lastSecond %lu ", currentTime, lastSecond );
+    char *p = formatText( buf, "\r\nSecond " );
+    p = formatDecimal( p, currentSecond );
+    p = formatText( p, " MSF bit " );
+    p = formatDecimal( p, currentBit );
+    p = formatText( p, " " );
+    *p = '\0';
     //serialTXString(buf);
 #endif
 
-    // Keep track of the AVR clock time for this second
-    // If we lose the MSF signal we can still make our own second tick
-    lastSecond = currentTime;
-
     // Move to the next second. May have to increment minutes, hours, date, day
     // Use >= instead of == just in case we end up with an odd time or date
     if( currentSecond >= 59 )
@@ -926,229 +1336,448 @@ static void newSecond( uint32_t currentTime )
     {
         currentSecond++;
     }
+
+    PROFILE_START( PROFILE_DISPLAY_TIME );
     displayTime();
+    PROFILE_END( PROFILE_DISPLAY_TIME );
 }
 
-// Process the data received from MSF
-static void processRX( bool signal, uint32_t currentTime )
+// Works out a soft value for the carrier over part of a second from the
+// sum of the block magnitudes. It is the distance of the average magnitude
+// from halfway between the carrier off and on levels scaled to +/-SOFT_MAX,
+// positive when the carrier is off.
+static int8_t sliceSoftValue( int32_t sum, uint8_t count )
 {
-    // Note the time at which the signal has gone high or low
-    static uint32_t highTime, lowTime;
+    int32_t mid = (sliceOffLevel + sliceOnLevel) / 2;
+    int32_t half = (sliceOnLevel - sliceOffLevel) / 2;
 
-    static uint32_t nextTimeout;
-    static enum
+    if( (count == 0) || (half <= 0) )
     {
-        IDLE,
-        NEW_SECOND,
-        A1,
-        A0,
-        B1,
-        B0
-    } eState = IDLE;
+        return 0;
+    }
 
-    // The previous signal state
-    static bool bSignal;
-    
-    // Process the signal if it has changed
-    if( signal != bSignal )
+    int32_t soft = (mid - sum / count) * SOFT_MAX / half;
+    if( soft > SOFT_MAX )
     {
-        bSignal = signal;
-        if( bSignal )
-        {
-            highTime = currentTime;
+        soft = SOFT_MAX;
+    }
+    else if( soft < -SOFT_MAX )
+    {
+        soft = -SOFT_MAX;
+    }
+    return soft;
+}
 
-            // Going high after at least 400ms is a minute marker
-            // Only accept this if we are getting good second pulses
-            // Otherwise regaining the signal after loss looks like a minute
-            // pulse.
-            if( bGoodSecond && (currentTime - lowTime > 400) )
-            {
-                bGoodMinute = true;
+// Start a new second for the soft slicer
+// Any bit from the previous second that hasn't been finished is finished now
+static void sliceNewSecond( uint32_t secondTime )
+{
+    if( !bSliceDone )
+    {
+        sliceFinish();
+    }
 
-                // Note the time we got the minute pulse
-                lastMinute = currentTime;
+    // Update the carrier levels from the second that has just finished
+    if( sliceCountOff )
+    {
+        sliceOffLevel += (sliceSumOff / sliceCountOff - sliceOffLevel) >> SLICE_LEVEL_SHIFT;
+    }
+    if( sliceCountOn )
+    {
+        sliceOnLevel += (sliceSumOn / sliceCountOn - sliceOnLevel) >> SLICE_LEVEL_SHIFT;
+    }
 
-                // The last second must have happened 500ms ago
-                // This ensures we will use the next second pulse
-                // instead of forcing a second
-                lastSecond = currentTime - 500;
+    sliceStart = secondTime;
+    sliceBit = currentBit;
+    sliceSumA = sliceSumB = sliceSumMarker = sliceSumOff = sliceSumOn = 0;
+    sliceCountA = sliceCountB = sliceCountMarker = sliceCountOff = sliceCountOn = 0;
+    bSliceDone = bMarkerDone = false;
+}
 
-                // Start loading received bits at the beginning again
-                currentBit = 0;
+// Finish slicing the A and B bits of a second
+// A bit is 1 when the carrier is off for its window. How sure we are of
+// that gives the confidence.
+static void sliceFinish( void )
+{
+    int8_t softA = sliceSoftValue( sliceSumA, sliceCountA );
+    int8_t softB = sliceSoftValue( sliceSumB, sliceCountB );
 
-                // We have a whole minute's worth of data so process it
-                processRXData();
-            }
+    bSliceDone = true;
 
-            switch( eState )
-            {
-                case NEW_SECOND:
-                    eState = IDLE;
-                    break;
+    setFrameBit( &bitsA, sliceBit, softA > 0 );
+    setFrameBit( &bitsB, sliceBit, softB > 0 );
+    confidenceA[sliceBit] = (uint16_t) ((softA < 0) ? -softA : softA) * CONFIDENCE_MAX / SOFT_MAX;
+    confidenceB[sliceBit] = (uint16_t) ((softB < 0) ? -softB : softB) * CONFIDENCE_MAX / SOFT_MAX;
 
-                case A1:
-                    eState = A0;
-                    break;
+    // Keep the A bits of the last few seconds for finding the minute marker
+    for( uint8_t i = 0 ; i < MARKER_LEN - 1 ; i++ )
+    {
+        markerSoftA[i] = markerSoftA[i + 1];
+    }
+    markerSoftA[MARKER_LEN - 1] = softA;
+}
 
-                case B1:
-                    eState = B0;
-                    break;
+// Correlates the second that has just been sliced with the minute marker
+// Returns a score out of MARKER_SCORE_MAX
+static int16_t markerScore( void )
+{
+    int16_t score = sliceSoftValue( sliceSumB, sliceCountB ) +
+                    (MARKER_REST_WEIGHT - 1) * sliceSoftValue( sliceSumMarker, sliceCountMarker );
 
-                default:
-                    break;
-            }
+    for( uint8_t i = 0 ; i < MARKER_LEN ; i++ )
+    {
+        if( (MARKER_PATTERN >> (MARKER_LEN - 1 - i)) & 1 )
+        {
+            score += markerSoftA[i];
         }
         else
         {
-            // Keep track of how long the signal is low
-            lowTime = currentTime;
+            score -= markerSoftA[i];
+        }
+    }
 
-            // Going low after at least 400ms high is a new second
-            if( currentTime - highTime > 400 )
-            {
-                // Only trigger a new second if the signal is good to
-                // prevent spurious seconds if the signal is poor
-                if( bGoodSignal )
-                {
-                    newSecond(currentTime);
-                }
-                nextTimeout = currentTime + 50;
-                eState = NEW_SECOND;
-                bGoodSecond = true;
-
-                // Note the time we got the pulse
-                // Used to display if second pulses are being received
-                lastSecondPulse = currentTime;
-
-                // Move to the next bit of MSF data to receive but don't go
-                // too far
-                currentBit++;
-                if( currentBit >= NUM_BITS )
-                {
-                    currentBit = 0;
-                }
-            }
+    return score;
+}
 
-            switch( eState )
-            {
-                case A0:
-                eState = IDLE;
-                break;
+// Called when the minute marker has been found
+static void newMinute( uint32_t markerTime )
+{
+    bGoodMinute = true;
 
-                case B0:
-                eState = B1;
-                break;
+    // Note the time we got the minute pulse
+    lastMinute = markerTime;
+    bReadRTC = false;
 
-                default:
-                break;
-            }
-        }
+    // Start loading received bits at the beginning again
+    currentBit = 0;
+
+    // We have a whole minute's worth of data so process it
+    PROFILE_START( PROFILE_PROCESS_RX_DATA );
+    processRXData(markerTime);
+    PROFILE_END( PROFILE_PROCESS_RX_DATA );
+}
+
+// Add a Goertzel block to the soft slicer
+// The magnitude is summed over the part of the A and B windows that the
+// block's Goertzel window lies completely inside. The carrier off and on
+// levels are learnt from the parts of the second where the carrier is
+// always off (the first 100ms) and always on (the end of the second).
+// The part of the second after the B bit is used to look for the minute
+// marker.
+static void sliceBlock( const RX_BLOCK *block )
+{
+    // Work out where the block started in the second
+    int32_t offset = block->time - sliceStart - ioGetRXWindowMS();
+    int32_t end = offset + ioGetRXWindowMS();
+
+    if( offset < SLICE_MARGIN )
+    {
+        return;
+    }
+
+    if( end <= SLICE_A_START - SLICE_MARGIN )
+    {
+        sliceSumOff += block->magnitude;
+        sliceCountOff++;
+    }
+    else if( (offset >= SLICE_A_START + SLICE_MARGIN) && (end <= SLICE_B_START - SLICE_MARGIN) )
+    {
+        sliceSumA += block->magnitude;
+        sliceCountA++;
+    }
+    else if( (offset >= SLICE_B_START + SLICE_MARGIN) && (end <= SLICE_B_END - SLICE_MARGIN) )
+    {
+        sliceSumB += block->magnitude;
+        sliceCountB++;
     }
-    
-    // Process a timeout
-    else if( currentTime > nextTimeout )
+    else if( (offset >= SLICE_B_END + SLICE_MARGIN) && (end <= SLICE_MARKER_END - SLICE_MARGIN) )
+    {
+        sliceSumMarker += block->magnitude;
+        sliceCountMarker++;
+    }
+    else if( (offset >= SLICE_ON_START) && (end <= SLICE_ON_END) )
+    {
+        sliceSumOn += block->magnitude;
+        sliceCountOn++;
+    }
+
+    // Finish the bits once the B window is over
+    if( !bSliceDone && (offset >= SLICE_B_END) )
+    {
+        sliceFinish();
+    }
+
+    // Then see if this was the minute marker
+    if( !bMarkerDone && (offset >= SLICE_MARKER_END) )
     {
-        switch( eState )
+        bMarkerDone = true;
+        if( markerScore() >= MARKER_THRESHOLD )
         {
-            case NEW_SECOND:
-                eState = A1;
-                nextTimeout = currentTime + 60;
-                break;
+            newMinute( sliceStart );
+        }
+    }
+}
 
-            case A1:
-                eState = B1;
-                nextTimeout = currentTime + 100;
-                bitA[currentBit] = 1;
-#ifdef DEBUG
-                sprintf(buf, "A(%u)=1 ", currentBit);
-                //serialTXString(buf);
-#endif
-                break;
+// Moves the next tick on by an amount in ms with a TICK_FRACTION_BITS
+// fraction, which can be negative
+static void tickMove( int32_t amount )
+{
+    int32_t fraction = tickFraction + amount;
 
-            case A0:
-                eState = B0;
-                nextTimeout = currentTime + 100;
-                bitA[currentBit] = 0;
-#ifdef DEBUG
-                sprintf(buf, "A(%u)=0 ", currentBit);
-                //serialTXString(buf);
-#endif
-                break;
+    tickTime += fraction >> TICK_FRACTION_BITS;
+    tickFraction = (uint16_t) fraction;
+}
 
-            case B1:
-                eState = IDLE;
-                bitB[currentBit] = 1;
-#ifdef DEBUG
-                sprintf(buf, "B(%u)=1 ", currentBit);
-                //serialTXString(buf);
-#endif
-                break;
+// Called for each local second tick
+static void secondTick( uint32_t currentTime )
+{
+    lastTick = currentTime;
 
-            case B0:
-                eState = IDLE;
-                bitB[currentBit] = 0;
-#ifdef DEBUG
-                sprintf(buf, "B(%u)=0 ", currentBit);
-                //serialTXString(buf);
-#endif
-                break;
+    newSecond();
 
-            default:
-                break;
+    // If the TWI queue is full try again at the next tick
+    if( bWriteRTC && writeRTCTime() )
+    {
+        bWriteRTC = false;
+    }
+
+    // Move to the next bit of MSF data to receive but don't go
+    // too far
+    currentBit++;
+    if( currentBit >= NUM_BITS )
+    {
+        currentBit = 0;
+    }
+
+    sliceNewSecond(currentTime);
+}
+
+// Moves the ticks into phase with a marker and restarts the loop
+// Only the phase moves, no tick is added. If the tick for the marker's
+// second has already happened the bits are sliced from the marker and the
+// next tick is a second on. Otherwise the tick that was still to come is
+// made due at the marker and handleRX() counts it with the next block.
+static void tickSnap( uint32_t markerTime, bool bTicked )
+{
+    tickTime = markerTime;
+    tickFraction = 0;
+
+    bTickLocked = false;
+    tickCandidateCount = 0;
+    tickFreqShift = TICK_FREQ_SHIFT_MIN;
+    tickFreqCount = 0;
+
+    if( bTicked )
+    {
+        tickMove( tickPeriod );
+        sliceNewSecond(markerTime);
+    }
+}
+
+// Works out how far a second marker is from the tick for its second
+// This is the last tick if it was less than half a second before the
+// marker, otherwise it is the next one
+static int16_t tickError( uint32_t markerTime, bool *bTicked )
+{
+    *bTicked = (int32_t) (markerTime - lastTick) < 500;
+    return markerTime - (*bTicked ? lastTick : tickTime);
+}
+
+// Locks the local second tick to a second marker
+static void tickLock( uint32_t markerTime )
+{
+    bool bTicked;
+    int16_t error = tickError( markerTime, &bTicked );
+
+    if( (error >= -TICK_WINDOW_MS) && (error <= TICK_WINDOW_MS) )
+    {
+        tickCandidateCount = 0;
+
+        if( bTickLocked )
+        {
+            // Correct part of the phase error and learn the period
+            // A late marker means the period is too short
+            tickMove( (int32_t) error * ((1L << TICK_FRACTION_BITS) / TICK_PHASE_DIV) );
+            tickPeriod += ((int32_t) error * (1L << TICK_FRACTION_BITS)) >> tickFreqShift;
+
+            if( tickPeriod > TICK_PERIOD_NOMINAL + TICK_PERIOD_MAX_ERROR )
+            {
+                tickPeriod = TICK_PERIOD_NOMINAL + TICK_PERIOD_MAX_ERROR;
+            }
+            else if( tickPeriod < TICK_PERIOD_NOMINAL - TICK_PERIOD_MAX_ERROR )
+            {
+                tickPeriod = TICK_PERIOD_NOMINAL - TICK_PERIOD_MAX_ERROR;
+            }
+
+            // Narrow the loop the longer it stays locked
+            if( (tickFreqShift < TICK_FREQ_SHIFT_MAX) && (++tickFreqCount >= (1U << tickFreqShift)) )
+            {
+                tickFreqShift++;
+                tickFreqCount = 0;
+            }
+        }
+        else
+        {
+            // Follow the markers exactly until there are enough of them in
+            // a row to lock to
+            tickLockCount++;
+            tickSnap( markerTime, bTicked );
+            if( tickLockCount >= TICK_LOCK_COUNT )
+            {
+                bTickLocked = true;
+            }
         }
     }
+    else if( bTickLocked )
+    {
+        // Only give up the lock if the markers keep agreeing somewhere else
+        if( (tickCandidateCount == 0) || (error < tickCandidate - TICK_WINDOW_MS) || (error > tickCandidate + TICK_WINDOW_MS) )
+        {
+            tickCandidateCount = 0;
+        }
+        tickCandidate = error;
+        tickCandidateCount++;
+
+        if( tickCandidateCount >= TICK_RELOCK_COUNT )
+        {
+            tickLockCount = 0;
+            tickSnap( markerTime, bTicked );
+        }
+    }
+    else
+    {
+        tickLockCount = 0;
+        tickSnap( markerTime, bTicked );
+    }
 }
 
-// Handle data received from MSF.
-static void handleRX(uint32_t currentTime)
+// Called for each second marker received from MSF
+static void secondMarker( uint32_t markerTime )
 {
-    // Read the current carrier state
-    bool carrier = ioReadRXInput();
+    bGoodSecond = true;
+
+    // Note the time we got the pulse
+    // Used to display if second pulses are being received
+    lastSecondPulse = markerTime;
 
-    static uint32_t previousTime;
+    tickLock( markerTime );
+}
 
-    // The current state of the carrier
-    static bool currentCarrier;
+#ifdef RTC_SQW_INT0
+// Called for each falling edge of the RTC's 1Hz output
+// While MSF seconds are being received this measures where the edges are
+// and once they have been lost the edges keep the tick locked instead
+static void rtcSecond( uint32_t edgeTime )
+{
+    if( bGoodSecond )
+    {
+        if( bTickLocked )
+        {
+            bool bTicked;
+            int16_t error = tickError( edgeTime, &bTicked ) << SQW_OFFSET_SHIFT;
 
-    // If the state has changed then note the time
-    if( carrier != currentCarrier )
+            if( bSQWOffset )
+            {
+                sqwOffset += (error - sqwOffset) >> SQW_OFFSET_SHIFT;
+            }
+            else
+            {
+                sqwOffset = error;
+                bSQWOffset = true;
+            }
+        }
+    }
+    else if( bSQWOffset )
     {
-        previousTime = currentTime;
-        currentCarrier = carrier;
+        tickLock( edgeTime - (sqwOffset >> SQW_OFFSET_SHIFT) );
     }
+}
+#endif
 
-    // Only process the carrier state if it has been stable for long enough
-    if( currentTime - previousTime > 20 )
+// Process the carrier edges received from MSF
+// These give the second markers, the data bits and minute marker
+// are worked out by the soft slicer
+static void processRX( bool signal, uint32_t currentTime )
+{
+    // Note the time at which the signal has gone high
+    static uint32_t highTime;
+
+    // The previous signal state
+    static bool bSignal;
+
+    // Process the signal if it has changed
+    if( signal != bSignal )
     {
-        if( currentCarrier )
+        bSignal = signal;
+        if( bSignal )
         {
-            processRX( true, currentTime );
+            highTime = currentTime;
         }
         else
         {
-            processRX( false, currentTime );
+            // Going low after at least 400ms high is a second marker
+            if( currentTime - highTime > 400 )
+            {
+                secondMarker(currentTime);
+            }
         }
     }
 }
 
-// If we lose the MSF signal the clock must carry on
-void autonomousClock( uint32_t currentTime )
+// Handle data received from MSF.
+static void handleRX(uint32_t currentTime)
 {
-    // If it has been a lot more than a second since we last
-    // received a second pulse then we'll force one.
-    if( (currentTime - lastSecond) >= 1200 )
+    RX_BLOCK block;
+    bool carrier;
+    uint32_t edgeTime;
+
+    // Go through every Goertzel block from the ADC interrupt. Each one
+    // goes to the soft slicer and the local second ticks and carrier edges
+    // are processed in the order they happened.
+    while( ioGetRXBlock( &block ) )
     {
-        // The signal is missing
-        bGoodSignal = false;
+        // Make the local second ticks due by the end of the block
+        while( (int32_t) (block.time - tickTime) >= 0 )
+        {
+            uint32_t t = tickTime;
+            tickMove( tickPeriod );
+            secondTick( t );
+        }
 
-        // Use the time when the second should have started
-        newSecond(currentTime - 200);
+        sliceBlock( &block );
+
+        if( ioFindRXEdge( &block, &carrier, &edgeTime ) )
+        {
+            // An edge detected since we read the time must not appear
+            // to be in the future
+            if( (int32_t) (edgeTime - currentTime) > 0 )
+            {
+                edgeTime = currentTime;
+            }
+
+            PROFILE_START( PROFILE_PROCESS_RX );
+            processRX( carrier, edgeTime );
+            PROFILE_END( PROFILE_PROCESS_RX );
+        }
     }
 
+#ifdef RTC_SQW_INT0
+    if( ioGetRTCSecond( &edgeTime ) )
+    {
+        rtcSecond( edgeTime );
+    }
+#endif
+}
+
+// If we lose the MSF signal the clock must carry on
+void autonomousClock( uint32_t currentTime )
+{
     // If it has been a lot more than a second since we last
-    // received a second pulse then will display that fact
+    // received a second pulse then the signal is missing and we will
+    // display that fact. The local tick keeps the seconds going.
     if( (currentTime - lastSecondPulse) >= 1200 )
     {
+        bGoodSignal = false;
         bGoodSecond = false;
     }
 
@@ -1158,17 +1787,50 @@ void autonomousClock( uint32_t currentTime )
     {
         bGoodMinute = false;
 
-        // Read the time from the RTC chip as it should be
-        // more accurate than using the AVR timer
-        readRTCTime();
+        // Read the time from the RTC chip once as it should be more
+        // accurate than counting seconds. The RTC's seconds are in step
+        // with the tick so read it half way through a second.
+        if( !bReadRTC && ((currentTime - lastTick) >= 500) )
+        {
+            bReadRTC = readRTCTime();
+        }
     }
 }
 
 static void loop(void)
 {
+    // Sleep until the ADC interrupt passes us a block. Every conversion
+    // wakes us up but most don't complete a block so go straight back
+    // to sleep. Interrupts are disabled while checking so that a block
+    // arriving just before going to sleep isn't missed - sleep_cpu() is
+    // always executed before any interrupt after sei().
+    // Idle mode has to be used as ADC noise reduction mode would stop
+    // timer 0 which generates the LO.
+    cli();
+    while( !ioRXBlockReady() )
+    {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        cli();
+    }
+    sei();
+
     uint32_t currentTime = millis();
+
+    PROFILE_START( PROFILE_HANDLE_RX );
     handleRX(currentTime);
+    PROFILE_END( PROFILE_HANDLE_RX );
+
     autonomousClock(currentTime);
+
+    // Finish off any I2C transactions that have completed
+    twiPoll();
+
+#ifdef PROFILE
+    profilePoll();
+#endif
 }
 
 int main(void)
@@ -1176,11 +1838,23 @@ int main(void)
     millisInit();
     ioInit();
 
-#ifdef DEBUG
+    // Start the local second tick straight away
+    tickTime = millis();
+
+    // The main loop sleeps when there is nothing to do
+    set_sleep_mode(SLEEP_MODE_IDLE);
+
+#if defined(DEBUG) || defined(PROFILE)
     serialInit(57600);
 #endif
 
+#ifdef PROFILE
+    profileInit();
+#endif
+
+    // The display starts off blank
     displayInit();
+    memset( lcdShadow, ' ', sizeof(lcdShadow) );
 
     i2cInit();
 
@@ -0,0 +1,241 @@
+/*
+ * profile.c
+ *
+ * Cycle counting profiler for the interrupt handlers and the main loop.
+ *
+ * Timer 1 counts CPU cycles with its overflows counted in software to
+ * give a 32 bit count. For each probe the number of calls and the
+ * minimum, mean and maximum cycles are kept along with a histogram in
+ * powers of 2. The cycles for an interrupt handler don't include the
+ * entry and exit code or the time taken reading the timer.
+ *
+ * With COHERENT_ADC timer 1 is already running to trigger the ADC so
+ * its periods are counted instead of its overflows.
+ *
+ * Sending 'p' on the serial port dumps the statistics, one probe per
+ * pass around the main loop so the serial buffer doesn't overflow.
+ * Sending 'r' resets them.
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+
+#include "config.h"
+#include "serial.h"
+#include "format.h"
+#include "profile.h"
+
+#ifdef PROFILE
+
+// The statistics and the debug strings together are over 2KB of RAM
+#ifdef DEBUG
+#error PROFILE and DEBUG together need more RAM than there is
+#endif
+
+// The histogram starts at under 64 cycles and doubles for each bucket
+// The last bucket is 64k cycles (4ms) and over
+#define PROFILE_BUCKETS      12
+#define PROFILE_FIRST_BUCKET 64
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t total;
+    uint32_t min;
+    uint32_t max;
+    uint16_t histogram[PROFILE_BUCKETS];
+} PROFILE_STATS;
+
+static PROFILE_STATS stats[NUM_PROFILES];
+
+static const char *probeText[NUM_PROFILES] =
+{
+    "ADC ISR     ",
+    "TWI ISR     ",
+    "handleRX    ",
+    "processRX   ",
+    "processData ",
+    "displayTime ",
+    "RTC I2C     ",
+};
+
+#ifdef COHERENT_ADC
+// Cycles up to the start of the current timer period
+static volatile uint32_t periodCycles;
+#else
+// Top 16 bits of the cycle count
+static volatile uint16_t overflows;
+#endif
+
+// The next probe to dump or NUM_PROFILES if not dumping
+static uint8_t dumpProbe = NUM_PROFILES;
+
+#ifdef COHERENT_ADC
+ISR (TIMER1_COMPA_vect)
+{
+    periodCycles += OCR1A + 1;
+}
+#else
+ISR (TIMER1_OVF_vect)
+{
+    overflows++;
+}
+#endif
+
+static void resetStats( void )
+{
+    memset( stats, 0, sizeof(stats) );
+    for( uint8_t i = 0 ; i < NUM_PROFILES ; i++ )
+    {
+        stats[i].min = UINT32_MAX;
+    }
+}
+
+void profileInit( void )
+{
+#ifdef COHERENT_ADC
+    // ioInit() has set timer 1 running in CTC mode with no prescaler
+    TIMSK1 = (1<<OCIE1A);
+#else
+    // Normal mode with no prescaler
+    TCCR1A = 0;
+    TCCR1B = (1<<CS10);
+    TIMSK1 = (1<<TOIE1);
+#endif
+
+    resetStats();
+}
+
+uint32_t profileCycles( void )
+{
+    uint8_t sreg = SREG;
+    cli();
+
+    uint16_t low = TCNT1;
+#ifdef COHERENT_ADC
+    uint32_t cycles = periodCycles + low;
+    uint16_t top = OCR1A;
+
+    // A period that hasn't been counted yet. If the count is small the
+    // timer cleared before it was read.
+    if( (TIFR1 & (1<<OCF1A)) && low < top / 2 )
+    {
+        cycles += top + 1;
+    }
+
+    SREG = sreg;
+    return cycles;
+#else
+    uint16_t high = overflows;
+
+    // An overflow that hasn't been counted yet. If the count is small
+    // it happened before the count was read.
+    if( (TIFR1 & (1<<TOV1)) && low < 0x8000 )
+    {
+        high++;
+    }
+
+    SREG = sreg;
+    return ((uint32_t) high << 16) | low;
+#endif
+}
+
+void profileRecord( PROFILE_PROBE probe, uint32_t cycles )
+{
+    PROFILE_STATS *s = &stats[probe];
+
+    // Halve the totals rather than overflow so the mean stays right
+    if( s->total > UINT32_MAX - cycles )
+    {
+        s->total >>= 1;
+        s->count >>= 1;
+    }
+    s->count++;
+    s->total += cycles;
+
+    if( cycles < s->min )
+    {
+        s->min = cycles;
+    }
+    if( cycles > s->max )
+    {
+        s->max = cycles;
+    }
+
+    uint8_t bucket = 0;
+    uint32_t limit = PROFILE_FIRST_BUCKET;
+    while( bucket < PROFILE_BUCKETS - 1 && cycles >= limit )
+    {
+        bucket++;
+        limit <<= 1;
+    }
+    if( s->histogram[bucket] < UINT16_MAX )
+    {
+        s->histogram[bucket]++;
+    }
+}
+
+// Sends some text followed by a number
+// Sent a field at a time so the buffer only needs to hold one number
+static void sendField( const char *text, uint32_t value )
+{
+    char buf[FORMAT_DECIMAL_LEN + 1];
+
+    serialTXString( (char *) text );
+    *formatDecimal( buf, value ) = '\0';
+    serialTXString( buf );
+}
+
+// Sends the line for one probe
+static void dumpStats( uint8_t probe )
+{
+    PROFILE_STATS s;
+
+    // The interrupt handlers update their statistics at any time
+    cli();
+    s = stats[probe];
+    sei();
+
+    sendField( probeText[probe], s.count );
+    if( s.count )
+    {
+        sendField( " min ", s.min );
+        sendField( " mean ", s.total / s.count );
+        sendField( " max ", s.max );
+        serialTXString( " |" );
+        for( uint8_t i = 0 ; i < PROFILE_BUCKETS ; i++ )
+        {
+            sendField( " ", s.histogram[i] );
+        }
+    }
+    serialTXString( "\r\n" );
+}
+
+void profilePoll( void )
+{
+    uint8_t c;
+
+    if( serialRXRead( &c ) )
+    {
+        if( c == 'p' )
+        {
+            serialTXString( "\r\nCycles: calls min mean max | from <64 doubling to >=64k\r\n" );
+            dumpProbe = 0;
+        }
+        else if( c == 'r' )
+        {
+            cli();
+            resetStats();
+            sei();
+        }
+    }
+
+    if( dumpProbe < NUM_PROFILES )
+    {
+        dumpStats( dumpProbe++ );
+    }
+}
+
+#endif
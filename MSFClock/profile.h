@@ -0,0 +1,55 @@
+/*
+ * profile.h
+ *
+ * Cycle counting profiler for the interrupt handlers and the main loop.
+ * Only built in when PROFILE is defined in config.h.
+ *
+ */
+
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+// The code that is profiled
+typedef enum
+{
+    PROFILE_ADC_ISR,
+    PROFILE_TWI_ISR,
+    PROFILE_HANDLE_RX,
+    PROFILE_PROCESS_RX,
+    PROFILE_PROCESS_RX_DATA,
+    PROFILE_DISPLAY_TIME,
+    PROFILE_RTC_I2C,
+    NUM_PROFILES
+} PROFILE_PROBE;
+
+#ifdef PROFILE
+
+// Put around the code to be profiled. Each probe may only be used from
+// one interrupt handler or from the main loop.
+#define PROFILE_START(probe) uint32_t profileStart_##probe = profileCycles()
+#define PROFILE_END(probe)   profileRecord( probe, profileCycles() - profileStart_##probe )
+
+// Starts timer 1 counting CPU cycles
+// Must be called after ioInit()
+void profileInit( void );
+
+// The number of CPU cycles since profileInit()
+// Safe to call with interrupts enabled or disabled
+uint32_t profileCycles( void );
+
+// Adds a measurement to a probe's statistics
+void profileRecord( PROFILE_PROBE probe, uint32_t cycles );
+
+// Called from the main loop. Sending 'p' on the serial port dumps the
+// statistics a line at a time and 'r' resets them.
+void profilePoll( void );
+
+#else
+
+#define PROFILE_START(probe)
+#define PROFILE_END(probe)
+
+#endif
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,23 @@
+/*
+ * avr/eeprom.h
+ *
+ * Host simulation stand-in for avr-libc EEPROM support.
+ * EEMEM variables are gathered into their own section which the
+ * simulator starts erased and can load from and save to a file.
+ *
+ */
+
+#ifndef SIM_AVR_EEPROM_H_
+#define SIM_AVR_EEPROM_H_
+
+#include <stddef.h>
+
+#define EEMEM __attribute__((section("eeprom")))
+
+void eeprom_read_block( void *dst, const void *src, size_t n );
+
+// Only writes the bytes that differ, each taking the time a real
+// EEPROM write would
+void eeprom_update_block( const void *src, void *dst, size_t n );
+
+#endif /* SIM_AVR_EEPROM_H_ */
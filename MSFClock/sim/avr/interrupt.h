@@ -0,0 +1,26 @@
+/*
+ * avr/interrupt.h
+ *
+ * Host simulation stand-in for avr-libc interrupt support.
+ * An ISR becomes an ordinary function that the simulator calls
+ * when the modelled peripheral would raise the interrupt.
+ *
+ */
+
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#define ISR(vector) void vector(void)
+
+// Interrupts are only ever delivered between firmware statements
+// so there is nothing to enable or disable
+#define sei()
+#define cli()
+
+void ADC_vect(void);
+void INT0_vect(void);
+void TWI_vect(void);
+void TIMER1_OVF_vect(void);
+void TIMER1_COMPA_vect(void);
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
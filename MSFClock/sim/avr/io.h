@@ -0,0 +1,210 @@
+/*
+ * avr/io.h
+ *
+ * Host simulation stand-in for the avr-libc register definitions.
+ * The ATmega328P I/O space is modelled as a plain byte array so that
+ * io.c and main.c compile unchanged. Only the registers and bits used
+ * by the firmware are defined.
+ *
+ */
+
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+// The data memory mapped I/O space 0x00-0xFF
+extern volatile uint8_t simIO[0x100];
+
+#define _SFR_MEM8(addr)  (simIO[(addr)])
+#define _SFR_MEM16(addr) (*(volatile uint16_t *)&simIO[(addr)])
+#define _SFR_IO8(addr)   _SFR_MEM8((addr) + 0x20)
+
+// Ports
+#define PINB    _SFR_IO8(0x03)
+#define DDRB    _SFR_IO8(0x04)
+#define PORTB   _SFR_IO8(0x05)
+#define PINC    _SFR_IO8(0x06)
+#define DDRC    _SFR_IO8(0x07)
+#define PORTC   _SFR_IO8(0x08)
+#define PIND    _SFR_IO8(0x09)
+#define DDRD    _SFR_IO8(0x0A)
+#define PORTD   _SFR_IO8(0x0B)
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PORTB0 0
+#define PORTB1 1
+#define PORTB2 2
+#define PORTB3 3
+#define PORTB4 4
+#define PORTB5 5
+#define PORTB6 6
+#define PORTB7 7
+
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PORTC0 0
+#define PORTC1 1
+#define PORTC2 2
+#define PORTC3 3
+#define PORTC4 4
+#define PORTC5 5
+
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PORTD0 0
+#define PORTD1 1
+#define PORTD2 2
+#define PORTD3 3
+#define PORTD4 4
+#define PORTD5 5
+#define PORTD6 6
+#define PORTD7 7
+
+// Timer 0
+#define TIFR0   _SFR_IO8(0x15)
+#define TCCR0A  _SFR_IO8(0x24)
+#define TCCR0B  _SFR_IO8(0x25)
+#define TCNT0   _SFR_IO8(0x26)
+#define OCR0A   _SFR_IO8(0x27)
+#define OCR0B   _SFR_IO8(0x28)
+#define TIMSK0  _SFR_MEM8(0x6E)
+
+#define TOV0    0
+#define OCF0A   1
+#define OCF0B   2
+#define WGM00   0
+#define WGM01   1
+#define COM0B0  4
+#define COM0B1  5
+#define COM0A0  6
+#define COM0A1  7
+#define CS00    0
+#define CS01    1
+#define CS02    2
+#define WGM02   3
+#define TOIE0   0
+#define OCIE0A  1
+#define OCIE0B  2
+
+// Timer 1
+#define TIFR1   _SFR_IO8(0x16)
+#define TIMSK1  _SFR_MEM8(0x6F)
+#define TCCR1A  _SFR_MEM8(0x80)
+#define TCCR1B  _SFR_MEM8(0x81)
+#define TCCR1C  _SFR_MEM8(0x82)
+#define TCNT1   _SFR_MEM16(0x84)
+#define ICR1    _SFR_MEM16(0x86)
+#define OCR1A   _SFR_MEM16(0x88)
+#define OCR1B   _SFR_MEM16(0x8A)
+
+#define TOV1    0
+#define OCF1A   1
+#define OCF1B   2
+#define ICF1    5
+#define TOIE1   0
+#define OCIE1A  1
+#define OCIE1B  2
+#define ICIE1   5
+#define WGM10   0
+#define WGM11   1
+#define COM1B0  4
+#define COM1B1  5
+#define COM1A0  6
+#define COM1A1  7
+#define CS10    0
+#define CS11    1
+#define CS12    2
+#define WGM12   3
+#define WGM13   4
+
+// General timer/counter control register
+#define GTCCR   _SFR_IO8(0x23)
+
+#define PSRSYNC 0
+#define PSRASY  1
+#define TSM     7
+
+// External interrupts
+#define EIFR    _SFR_IO8(0x1C)
+#define EIMSK   _SFR_IO8(0x1D)
+#define EICRA   _SFR_MEM8(0x69)
+
+#define INTF0   0
+#define INTF1   1
+#define INT0    0
+#define INT1    1
+#define ISC00   0
+#define ISC01   1
+#define ISC10   2
+#define ISC11   3
+
+// Sleep mode control and status register
+#define SMCR    _SFR_IO8(0x33)
+#define SREG    _SFR_IO8(0x3F)
+
+#define SE      0
+#define SM0     1
+#define SM1     2
+#define SM2     3
+
+// ADC
+#define ADC     _SFR_MEM16(0x78)
+#define ADCL    _SFR_MEM8(0x78)
+#define ADCH    _SFR_MEM8(0x79)
+#define ADCSRA  _SFR_MEM8(0x7A)
+#define ADCSRB  _SFR_MEM8(0x7B)
+#define ADMUX   _SFR_MEM8(0x7C)
+#define DIDR0   _SFR_MEM8(0x7E)
+
+#define ADPS0   0
+#define ADPS1   1
+#define ADPS2   2
+#define ADIE    3
+#define ADIF    4
+#define ADATE   5
+#define ADSC    6
+#define ADEN    7
+#define ADTS0   0
+#define ADTS1   1
+#define ADTS2   2
+#define MUX0    0
+#define ADLAR   5
+#define REFS0   6
+#define REFS1   7
+#define ADC0D   0
+#define ADC1D   1
+
+// TWI
+#define TWBR    _SFR_MEM8(0xB8)
+#define TWSR    _SFR_MEM8(0xB9)
+#define TWAR    _SFR_MEM8(0xBA)
+#define TWDR    _SFR_MEM8(0xBB)
+#define TWCR    _SFR_MEM8(0xBC)
+
+#define TWIE    0
+#define TWEN    2
+#define TWWC    3
+#define TWSTO   4
+#define TWSTA   5
+#define TWEA    6
+#define TWINT   7
+
+#endif /* SIM_AVR_IO_H_ */
@@ -0,0 +1,22 @@
+/*
+ * avr/sleep.h
+ *
+ * Host simulation stand-in for avr-libc sleep support.
+ * Sleeping moves simulated time on to the next interrupt.
+ *
+ */
+
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+#define SLEEP_MODE_IDLE 0
+
+// Sleeps until the next interrupt
+void simSleep(void);
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() simSleep()
+
+#endif /* SIM_AVR_SLEEP_H_ */
@@ -0,0 +1,61 @@
+#!/bin/sh
+################################################################################
+# Runs the simulator over a set of reception scenarios and prints a table
+# of how well the firmware did in each, to compare detector and decoder
+# changes. Each scenario is run for the same time with the same noise seed
+# so the results are repeatable.
+#
+# Usage: ./bench.sh [hours]
+################################################################################
+
+HOURS=${1:-2}
+SIM=./msfsim
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# Name and msfsim options for each scenario
+SCENARIOS="\
+strong|-a 36
+weak|-a 9
+very_weak|-a 6
+marginal|-a 5
+parity_votes|-a 4.5
+fading_50%|-a 12 -g 0.5 -G 60
+fading_80%|-a 12 -g 0.8 -G 120
+mains_impulses|-a 12 -i 100 -I 200
+smps_impulses|-a 12 -i 1000 -I 100
+lo_+20Hz|-a 12 -o 20
+lo_-40Hz|-a 12 -o -40
+cpu_+100ppm|-a 12 -p 100
+cpu_-4000ppm|-a 12 -p -4000
+cpu_drift_2ppm/h|-a 12 -r 2
+combined|-a 12 -g 0.5 -G 30 -i 100 -I 100 -o 10 -p 30 -r 1"
+
+# Run them all in parallel
+n=0
+while IFS='|' read -r name options
+do
+    n=$((n + 1))
+    $SIM -d "$HOURS" $options > "$OUT/$n" 2>&1 &
+done <<END
+$SCENARIOS
+END
+wait
+
+printf "%-18s %8s %8s %8s %9s %6s %7s\n" "Scenario" "C/N dB" "SNR dB" "Lock s" "Decoded" "Wrong" "BER"
+n=0
+while IFS='|' read -r name options
+do
+    n=$((n + 1))
+    awk -v name="$name" '
+        /^Carrier to noise/    { cn = $4 }
+        /^SNR in the bin/      { snr = $5 }
+        /^Time to first lock/  { lock = $5 }
+        /^Minutes decoded/     { decoded = $4; gsub( /[()]/, "", decoded ) }
+        /^Minutes wrong/       { wrong = $3 }
+        /^Frames received/     { ber = $7 }
+        END { printf "%-18s %8s %8s %8s %9s %6s %7s\n", name, cn, snr, lock, decoded, wrong, ber }
+    ' "$OUT/$n"
+done <<END
+$SCENARIOS
+END
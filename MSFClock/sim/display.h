@@ -0,0 +1,18 @@
+/*
+ * display.h
+ *
+ * Host simulation stand-in for the TARL display driver.
+ *
+ */
+
+#ifndef DISPLAY_H_
+#define DISPLAY_H_
+
+#include <stdint.h>
+
+void displayInit(void);
+void displayText( uint8_t line, const char *text, uint8_t bClearEOL );
+void displayCursor( uint8_t x, uint8_t y );
+void displayWriteChar( char c );
+
+#endif /* DISPLAY_H_ */
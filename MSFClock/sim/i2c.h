@@ -0,0 +1,18 @@
+/*
+ * i2c.h
+ *
+ * Host simulation stand-in for the TARL I2C driver.
+ * Functions return 0 on success.
+ *
+ */
+
+#ifndef I2C_H_
+#define I2C_H_
+
+#include <stdint.h>
+
+void i2cInit(void);
+uint8_t i2cReadRegister( uint8_t address, uint8_t reg, uint8_t *data );
+uint8_t i2cWriteRegister( uint8_t address, uint8_t reg, uint8_t data );
+
+#endif /* I2C_H_ */
@@ -0,0 +1,16 @@
+/*
+ * millis.h
+ *
+ * Host simulation stand-in for the TARL millisecond timer.
+ *
+ */
+
+#ifndef MILLIS_H_
+#define MILLIS_H_
+
+#include <stdint.h>
+
+void millisInit(void);
+uint32_t millis(void);
+
+#endif /* MILLIS_H_ */
@@ -0,0 +1,322 @@
+/*
+ * msfgen.c
+ *
+ * Generates the ADC samples the NE602 mixer output would give for
+ * the MSF time signal, or replays them from a file.
+ *
+ * The 60kHz carrier is mixed with the LO generated by timer 0 and the
+ * difference frequency is sampled by the ADC. The LO is worked out
+ * from OCR0A and the actual CPU clock so that any error in either is
+ * reflected in the IF the firmware sees.
+ *
+ * To try the receiver in poor conditions the carrier can fade, there
+ * can be impulse noise as well as Gaussian noise, the LO can be offset
+ * and the CPU clock can drift. With drift the CPU clock frequency
+ * changes linearly with time so the cycle count goes up with the
+ * square of the time.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <string.h>
+
+#include "config.h"
+#include "msfgen.h"
+
+// The MSF carrier frequency
+#define MSF_FREQUENCY 60000.0
+
+// Number of entries in the sine and noise tables
+// The tables hold the scaled carrier and the noise centred on
+// mid-scale, plus a half for rounding
+#define SINE_TABLE_LEN  1024
+#define NOISE_TABLE_LEN 16384
+
+// How much an impulse dies away each sample
+#define IMPULSE_DECAY 0.6f
+
+static MSF_GEN_CONFIG gen;
+
+// The CPU cycle count is F_CPU * (cycleRate * t + cycleAccel * t^2)
+// at t seconds from the start
+static double cycleRate, cycleAccel;
+
+static float sineTable[SINE_TABLE_LEN];
+static float noiseTable[NOISE_TABLE_LEN];
+static uint32_t rng;
+
+// IF phase as a fraction of a cycle scaled by 2^64 so that it wraps
+// around by itself
+static uint64_t phase;
+static uint64_t lastCycle;
+
+// The phase increment per CPU cycle and the OCR0A it was calculated for
+static uint64_t phasePerCycle;
+static int phaseOCR = -1;
+
+// The IF in Hz
+static double ifFrequency;
+
+// The carrier's gain as it fades, updated every slot
+static float fadeGain = 1.0f;
+
+// The current impulse and when the next one starts
+static float impulse;
+static double impulseTime;
+static uint64_t nextImpulseCycle = UINT64_MAX;
+
+// The carrier is on or off in 100ms slots
+static uint64_t nextSlotCycle;
+static int64_t slotSecond;
+static uint8_t slot;
+static uint16_t offMask;
+static uint8_t carrierOn;
+
+// The A and B bits for the minute being transmitted
+static time_t frameMinute = -1;
+static uint8_t frameA[60], frameB[60];
+
+static uint32_t xorshift( void )
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Writes a value into the frame as MSF's most significant bit first BCD
+static void putBCD( uint8_t *bits, uint8_t start, uint8_t len, uint8_t value )
+{
+    uint8_t bcd = ((value / 10) << 4) | (value % 10);
+
+    for( uint8_t i = 0 ; i < len ; i++ )
+    {
+        bits[start + i] = (bcd >> (len - 1 - i)) & 1;
+    }
+}
+
+// Sets the parity bit in B so that it plus the A bits has odd parity
+static void putParity( uint8_t *a, uint8_t *b, uint8_t start, uint8_t end, uint8_t parity )
+{
+    uint8_t count = 0;
+
+    for( uint8_t i = start ; i <= end ; i++ )
+    {
+        count += a[i];
+    }
+    b[parity] = !(count & 1);
+}
+
+void msfGenFrame( time_t minute, uint8_t *a, uint8_t *b )
+{
+    // The frame carries the UK civil time at the start of the next minute
+    time_t civil = minute + 60 + (gen.bst ? 3600 : 0);
+    struct tm tm;
+    gmtime_r( &civil, &tm );
+
+    memset( a, 0, 60 );
+    memset( b, 0, 60 );
+
+    // DUT1 is sent in unary, positive in B1-B8 and negative in B9-B16
+    for( int i = 0 ; i < gen.dut1 && i < 8 ; i++ )
+    {
+        b[1 + i] = 1;
+    }
+    for( int i = 0 ; i < -gen.dut1 && i < 8 ; i++ )
+    {
+        b[9 + i] = 1;
+    }
+
+    putBCD( a, 17, 8, tm.tm_year % 100 );
+    putBCD( a, 25, 5, tm.tm_mon + 1 );
+    putBCD( a, 30, 6, tm.tm_mday );
+    putBCD( a, 36, 3, tm.tm_wday );
+    putBCD( a, 39, 6, tm.tm_hour );
+    putBCD( a, 45, 7, tm.tm_min );
+
+    // Minute identifier 01111110
+    for( int i = 53 ; i <= 58 ; i++ )
+    {
+        a[i] = 1;
+    }
+
+    putParity( a, b, 17, 24, 54 );
+    putParity( a, b, 25, 35, 55 );
+    putParity( a, b, 36, 38, 56 );
+    putParity( a, b, 39, 51, 57 );
+
+    b[58] = gen.bst;
+}
+
+// Works out which 100ms slots of a second have the carrier off
+static uint16_t secondOffMask( int64_t second )
+{
+    time_t minute = (time_t) (second - (second % 60));
+    uint8_t s = second % 60;
+
+    if( s == 0 )
+    {
+        // Minute marker
+        return 0x1F;
+    }
+
+    if( minute != frameMinute )
+    {
+        msfGenFrame( minute, frameA, frameB );
+        frameMinute = minute;
+    }
+
+    return 0x01 | (frameA[s] << 1) | (frameB[s] << 2);
+}
+
+// The CPU cycle t seconds from the start
+static double cycleAt( double t )
+{
+    return F_CPU * (cycleRate * t + cycleAccel * t * t);
+}
+
+// The CPU clock frequency t seconds from the start
+static double frequencyAt( double t )
+{
+    return F_CPU * (cycleRate + 2.0 * cycleAccel * t);
+}
+
+// The CPU cycle at which a slot starts
+static uint64_t slotCycle( int64_t second, uint8_t n )
+{
+    return (uint64_t) ceil( cycleAt( (double) (second - gen.start) + n / 10.0 ) );
+}
+
+// Works out the IF and the fading for the slot
+static void slotUpdate( void )
+{
+    double t = (double) (slotSecond - gen.start) + slot / 10.0;
+    double frequency = frequencyAt( t );
+
+    // The IF depends on the LO which the firmware can change
+    double lo = frequency / (2.0 * (OCR0A + 1)) + gen.loOffset;
+    ifFrequency = fabs( MSF_FREQUENCY - lo );
+    phasePerCycle = ifFrequency / frequency * 18446744073709551616.0;
+    phaseOCR = OCR0A;
+
+    if( gen.fadePeriod > 0 )
+    {
+        fadeGain = 1.0 - gen.fadeDepth * (0.5 - 0.5 * cos( 2.0 * M_PI * t / gen.fadePeriod ));
+    }
+}
+
+void msfGenInit( const MSF_GEN_CONFIG *config )
+{
+    gen = *config;
+    cycleRate = 1.0 + gen.ppm / 1e6;
+    cycleAccel = gen.drift / 1e6 / 3600 / 2;
+
+    rng = gen.seed ? gen.seed : 1;
+
+    for( int i = 0 ; i < SINE_TABLE_LEN ; i++ )
+    {
+        sineTable[i] = gen.amplitude * sin( 2.0 * M_PI * i / SINE_TABLE_LEN );
+    }
+
+    // Box-Muller fills a table of normally distributed values which is
+    // then indexed at random for each sample
+    for( int i = 0 ; i < NOISE_TABLE_LEN ; i += 2 )
+    {
+        double u1 = (xorshift() + 1.0) / 4294967297.0;
+        double u2 = xorshift() / 4294967296.0;
+        double r = sqrt( -2.0 * log( u1 ) );
+        noiseTable[i] = 128.5 + gen.noise * r * cos( 2.0 * M_PI * u2 );
+        noiseTable[i + 1] = 128.5 + gen.noise * r * sin( 2.0 * M_PI * u2 );
+    }
+
+    slotSecond = gen.start;
+    slot = 0;
+    offMask = secondOffMask( slotSecond );
+    carrierOn = !(offMask & 1);
+    nextSlotCycle = slotCycle( slotSecond, 1 );
+
+    if( gen.impulseRate > 0 )
+    {
+        impulseTime = 0;
+        nextImpulseCycle = 0;
+    }
+}
+
+int msfGenSample( uint64_t cycle )
+{
+    if( gen.file )
+    {
+        int c = fgetc( gen.file );
+        return (c == EOF) ? -1 : c;
+    }
+
+    // Move the carrier on to the slot we are in now
+    while( cycle >= nextSlotCycle )
+    {
+        slot++;
+        if( slot >= 10 )
+        {
+            slot = 0;
+            slotSecond++;
+            offMask = secondOffMask( slotSecond );
+        }
+        carrierOn = !((offMask >> slot) & 1);
+        nextSlotCycle = slotCycle( slotSecond, slot + 1 );
+        phaseOCR = -1;
+    }
+
+    if( OCR0A != phaseOCR )
+    {
+        slotUpdate();
+    }
+    phase += (cycle - lastCycle) * phasePerCycle;
+    lastCycle = cycle;
+
+    float sample = noiseTable[xorshift() >> 18];
+    if( carrierOn )
+    {
+        sample += fadeGain * sineTable[phase >> 54];
+    }
+
+    // Each impulse starts with a random polarity and dies away
+    if( cycle >= nextImpulseCycle )
+    {
+        impulse = (xorshift() & 1) ? gen.impulseAmplitude : -gen.impulseAmplitude;
+        impulseTime += 1.0 / gen.impulseRate;
+        nextImpulseCycle = (uint64_t) ceil( cycleAt( impulseTime ) );
+    }
+    sample += impulse;
+    impulse *= IMPULSE_DECAY;
+
+    if( sample < 0.0f )
+    {
+        return 0;
+    }
+    else if( sample >= 255.0f )
+    {
+        return 255;
+    }
+    return (int) sample;
+}
+
+double msfGenIF( void )
+{
+    return ifFrequency;
+}
+
+double msfGenTime( uint64_t cycle )
+{
+    // Solve the quadratic for the time in the form that still works
+    // without any drift
+    double c = cycle / (double) F_CPU;
+    double t = 2.0 * c / (cycleRate + sqrt( cycleRate * cycleRate + 4.0 * cycleAccel * c ));
+
+    return gen.start + t;
+}
+
+double msfGenCycle( double time )
+{
+    return cycleAt( time - gen.start );
+}
@@ -0,0 +1,72 @@
+/*
+ * msfgen.h
+ *
+ * Generates the ADC samples the NE602 mixer output would give for
+ * the MSF time signal, or replays them from a file.
+ *
+ */
+
+#ifndef MSFGEN_H_
+#define MSFGEN_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct
+{
+    // UTC at the first CPU cycle
+    time_t start;
+
+    // Carrier amplitude and RMS noise in ADC counts
+    double amplitude;
+    double noise;
+
+    // Error of the CPU clock in parts per million and how fast it
+    // drifts in parts per million per hour
+    double ppm;
+    double drift;
+
+    // Error of the LO in Hz on top of any due to the CPU clock
+    double loOffset;
+
+    // The carrier fades by this fraction of its amplitude and back
+    // again over the period in seconds
+    double fadeDepth;
+    double fadePeriod;
+
+    // Impulses at this rate in Hz with this peak in ADC counts, such
+    // as from a mains rectifier or a switch mode supply
+    double impulseRate;
+    double impulseAmplitude;
+
+    // DUT1 in tenths of a second and whether BST is in force
+    int dut1;
+    int bst;
+
+    uint32_t seed;
+
+    // If set, samples are read from this file (unsigned 8 bit, one
+    // per ADC conversion) instead of being generated
+    FILE *file;
+} MSF_GEN_CONFIG;
+
+void msfGenInit( const MSF_GEN_CONFIG *config );
+
+// The ADC sample for a conversion completing at the given CPU cycle
+// Returns -1 when a replayed sample file is exhausted
+int msfGenSample( uint64_t cycle );
+
+// The IF the firmware is receiving in Hz
+double msfGenIF( void );
+
+// The true UTC, in seconds since the epoch, at the given CPU cycle
+double msfGenTime( uint64_t cycle );
+
+// The CPU cycle at the given UTC
+double msfGenCycle( double time );
+
+// Fills in the A and B bits transmitted in the minute starting at the given UTC
+void msfGenFrame( time_t minute, uint8_t *a, uint8_t *b );
+
+#endif /* MSFGEN_H_ */
@@ -0,0 +1,19 @@
+/*
+ * serial.h
+ *
+ * Host simulation stand-in for the TARL serial driver.
+ *
+ */
+
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include <stdint.h>
+
+void serialInit( uint32_t baud );
+void serialTXString( char *string );
+
+// Returns true if a character was read
+uint8_t serialRXRead( uint8_t *data );
+
+#endif /* SERIAL_H_ */
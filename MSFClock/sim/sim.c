@@ -0,0 +1,654 @@
+/*
+ * sim.c
+ *
+ * Host simulation of the MSF clock.
+ *
+ * Runs the firmware against a generated (or recorded) MSF signal much
+ * faster than real time and reports how well it did against the true
+ * time: how long it took to first decode the time, how many minutes
+ * were decoded or lost, and how often the display was right.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
+
+#include "config.h"
+#include "io.h"
+#include "sim.h"
+#include "msfgen.h"
+
+// The firmware's main() is renamed when it is built for the simulator
+int firmwareMain(void);
+
+volatile uint8_t simIO[0x100];
+
+uint64_t simCycles;
+uint64_t simSleepCycles;
+int simVerbose;
+
+// When the simulation ends and when the next ADC conversion completes
+static uint64_t endCycles;
+static uint64_t nextConversion;
+
+#ifdef RTC_SQW_INT0
+// The last falling edge of the RTC's 1Hz output
+static uint64_t lastSQW;
+#endif
+
+static MSF_GEN_CONFIG config;
+
+// The firmware's EEMEM variables, and the file the EEPROM is kept in
+// from one run to the next
+extern uint8_t __start_eeprom[] __attribute__((weak));
+extern uint8_t __stop_eeprom[] __attribute__((weak));
+static const char *eepromFile;
+
+// Writing a byte of EEPROM takes 3.4ms
+#define EEPROM_WRITE_CYCLES (F_CPU / 1000 * 34 / 10)
+
+// Results
+static uint32_t goodMinutes, badMinutes;
+static double firstLock = -1;
+
+// Frames passed on for decoding, and the bit errors in those received
+// since the first lock. Before then the frames include the partial one
+// the firmware was started part way through.
+static uint32_t rxFrames, rxBits, rxBitErrors;
+
+// Frames received with at least one parity check failing, which the
+// firmware can only use by voting or repairing them
+static uint32_t rxParityFails;
+
+static char displayLine[LCD_HEIGHT][LCD_WIDTH + 1];
+static uint32_t displayUpdates, displayCorrect;
+static double displayLagTotal, displayLagMax;
+
+// The time shown on the display and the true time it was shown at
+static double shownAt = -1;
+static time_t shown;
+
+// Total time the display was showing the correct time, overall and
+// since the first lock
+static double correctTime, correctTimeLocked;
+
+static const char *dayName[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+// ADC auto trigger sources
+#define ADC_TRIGGER_MASK     ((1<<ADTS2) | (1<<ADTS1) | (1<<ADTS0))
+#define ADC_TRIGGER_FREE     0
+#define ADC_TRIGGER_TIMER1_B ((1<<ADTS2) | (1<<ADTS0))
+
+// Timer 1 CTC mode with OCR1A as the top and no prescaler
+#define TIMER1_MODE_MASK     ((1<<WGM13) | (1<<WGM12) | (1<<CS12) | (1<<CS11) | (1<<CS10))
+#define TIMER1_CTC           ((1<<WGM12) | (1<<CS10))
+
+// There is no hook on register writes so this unused bit of TIFR1 is set
+// along with OCF1B when compare match B triggers a conversion. Clearing
+// the flag writes the whole register, which clears it too.
+#define TIFR1_UNCLEARED 7
+
+// True if conversions are triggered by timer 1 compare match B
+static int timerTriggered( void )
+{
+    return (ADCSRB & ADC_TRIGGER_MASK) == ADC_TRIGGER_TIMER1_B;
+}
+
+// Number of CPU cycles between ADC conversions, or 0 if the ADC is not
+// auto triggered with its interrupt enabled from a trigger that is modelled
+static uint32_t conversionCycles( void )
+{
+    uint8_t adcsra = ADCSRA;
+
+    if( (adcsra & ((1<<ADEN) | (1<<ADATE) | (1<<ADIE))) != ((1<<ADEN) | (1<<ADATE) | (1<<ADIE)) )
+    {
+        return 0;
+    }
+
+    uint8_t prescale = adcsra & ((1<<ADPS2) | (1<<ADPS1) | (1<<ADPS0));
+    uint32_t adcClock = 1UL << (prescale ? prescale : 1);
+
+    if( (ADCSRB & ADC_TRIGGER_MASK) == ADC_TRIGGER_FREE )
+    {
+        return 13 * adcClock;
+    }
+
+    if( timerTriggered() && (TCCR1B & TIMER1_MODE_MASK) == TIMER1_CTC && OCR1B <= OCR1A && !(GTCCR & (1<<TSM)) )
+    {
+        // A triggered conversion takes 13.5 ADC clocks and 3 cycles to
+        // synchronise. Triggers while one is running are lost.
+        uint32_t period = OCR1A + 1UL;
+        uint32_t busy = 27 * adcClock / 2 + 3;
+        return (busy + period - 1) / period * period;
+    }
+
+    return 0;
+}
+
+// Adds up how long the previous display contents were correct
+static void accountDisplay( double now )
+{
+    if( shownAt >= 0 )
+    {
+        double from = fmax( shownAt, shown );
+        double to = fmin( now, shown + 1 );
+
+        if( to > from )
+        {
+            correctTime += to - from;
+            double lockedFrom = fmax( from, config.start + firstLock );
+            if( firstLock >= 0 && to > lockedFrom )
+            {
+                correctTimeLocked += to - lockedFrom;
+            }
+        }
+    }
+}
+
+static void report( void )
+{
+    double now = msfGenTime( simCycles );
+    double duration = now - config.start;
+
+    accountDisplay( now );
+
+    // Count the minutes whose whole frame was transmitted during the run
+    time_t firstMinute = ((config.start + 59) / 60) * 60 + 60;
+    uint32_t minutes = 0;
+    if( now >= firstMinute + 1 )
+    {
+        minutes = (uint32_t) ((now - 1 - firstMinute) / 60) + 1;
+    }
+    uint32_t lost = (goodMinutes + badMinutes) > minutes ? 0 : minutes - goodMinutes - badMinutes;
+
+    printf( "Simulated time       %.1f s\n", duration );
+    if( !config.file && config.noise > 0 )
+    {
+        printf( "Carrier to noise     %.1f dB per sample\n", 10 * log10( config.amplitude * config.amplitude / 2 / (config.noise * config.noise) ) );
+    }
+    if( firstLock >= 0 )
+    {
+        printf( "Time to first lock   %.1f s\n", firstLock );
+    }
+    else
+    {
+        printf( "Time to first lock   never\n" );
+    }
+    printf( "Minutes transmitted  %u\n", minutes );
+    printf( "Minutes decoded      %u (%.1f%%)\n", goodMinutes, minutes ? 100.0 * goodMinutes / minutes : 0.0 );
+    printf( "Minutes wrong        %u\n", badMinutes );
+    printf( "Minutes lost         %u\n", lost );
+    if( !config.file )
+    {
+        if( rxBits )
+        {
+            printf( "Frames received      %u, bit error rate %.2f%% after lock\n", rxFrames, 100.0 * rxBitErrors / rxBits );
+        }
+        else
+        {
+            printf( "Frames received      %u, bit error rate n/a\n", rxFrames );
+        }
+    }
+    printf( "Frames bad parity    %u\n", rxParityFails );
+    if( !config.file )
+    {
+        printf( "IF                   %.1f Hz, measured %.1f Hz\n", msfGenIF(), ioGetIFFrequency() / 10.0 );
+        printf( "SNR in the bin       %u dB\n", ioGetSNR() );
+    }
+    printf( "Block overruns       %u\n", ioGetRXOverruns() );
+    printf( "Main loop latency    max %u ms\n", ioGetRXLatency() );
+    printf( "CPU asleep           %.1f%% of the time\n", 100.0 * simSleepCycles / simCycles );
+    printf( "Display updates      %u, %u correct when written\n", displayUpdates, displayCorrect );
+    if( displayCorrect )
+    {
+        printf( "Display lag          mean %.1f ms, max %.1f ms\n", 1000.0 * displayLagTotal / displayCorrect, 1000.0 * displayLagMax );
+    }
+    printf( "Display correct      %.2f%% of the time", 100.0 * correctTime / duration );
+    if( firstLock >= 0 && duration > firstLock )
+    {
+        printf( ", %.2f%% since first lock", 100.0 * correctTimeLocked / (duration - firstLock) );
+    }
+    printf( "\n" );
+}
+
+// Starts the EEPROM erased and then loads it from the file if there is one
+static void eepromLoad( void )
+{
+    memset( __start_eeprom, 0xFF, __stop_eeprom - __start_eeprom );
+
+    FILE *file = eepromFile ? fopen( eepromFile, "rb" ) : NULL;
+    if( file )
+    {
+        if( fread( __start_eeprom, 1, __stop_eeprom - __start_eeprom, file ) == 0 )
+        {
+            fprintf( stderr, "%s is empty\n", eepromFile );
+        }
+        fclose( file );
+    }
+}
+
+static void eepromSave( void )
+{
+    FILE *file = eepromFile ? fopen( eepromFile, "wb" ) : NULL;
+    if( file )
+    {
+        fwrite( __start_eeprom, 1, __stop_eeprom - __start_eeprom, file );
+        fclose( file );
+    }
+}
+
+void eeprom_read_block( void *dst, const void *src, size_t n )
+{
+    memcpy( dst, src, n );
+}
+
+void eeprom_update_block( const void *src, void *dst, size_t n )
+{
+    const uint8_t *from = src;
+    uint8_t *to = dst;
+
+    for( size_t i = 0 ; i < n ; i++ )
+    {
+        if( to[i] != from[i] )
+        {
+            to[i] = from[i];
+            simAdvance( EEPROM_WRITE_CYCLES );
+        }
+    }
+}
+
+static void finish( void )
+{
+    report();
+    eepromSave();
+    exit( 0 );
+}
+
+void simAdvance( uint32_t cycles )
+{
+    // Anything the firmware has started on the TWI since it last took
+    // any time started at the beginning of this step
+    twiModelCheck( simCycles );
+
+    simCycles += cycles;
+
+    // Deliver the interrupts that fall due in time order
+    for( ;; )
+    {
+        uint64_t twi = twiModelNext();
+#ifdef RTC_SQW_INT0
+        uint64_t sqw = rtcModelSQWEdge( lastSQW );
+#else
+        uint64_t sqw = UINT64_MAX;
+#endif
+
+        if( twi <= simCycles && twi <= sqw && twi <= nextConversion )
+        {
+            twiModelEvent();
+        }
+#ifdef RTC_SQW_INT0
+        else if( sqw <= simCycles && sqw < nextConversion )
+        {
+            lastSQW = sqw;
+            if( EIMSK & (1<<INT0) )
+            {
+                INT0_vect();
+            }
+        }
+#endif
+        else if( nextConversion <= simCycles )
+        {
+            uint32_t period = conversionCycles();
+            if( period == 0 )
+            {
+                // The ADC isn't running yet so look again later
+                nextConversion = simCycles + 1;
+                break;
+            }
+
+            // A compare match only triggers a conversion if the
+            // firmware cleared the flag after the last one
+            if( timerTriggered() )
+            {
+                if( TIFR1 & (1<<TIFR1_UNCLEARED) )
+                {
+                    nextConversion += period;
+                    continue;
+                }
+                TIFR1 |= (1<<OCF1B) | (1<<TIFR1_UNCLEARED);
+            }
+
+            int sample = msfGenSample( nextConversion );
+            if( sample < 0 )
+            {
+                simCycles = nextConversion;
+                finish();
+            }
+
+            ADCH = sample;
+            ADC_vect();
+            nextConversion += period;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if( simCycles >= endCycles )
+    {
+        finish();
+    }
+}
+
+void simSleep( void )
+{
+    twiModelCheck( simCycles );
+
+    // Only look at the display once the firmware has finished sending
+    // to it rather than part way through an update
+    if( twiModelNext() == UINT64_MAX )
+    {
+        displayModelCheck();
+    }
+
+    // Wake up when the next ADC conversion or TWI operation completes
+    uint64_t wake = nextConversion;
+    if( twiModelNext() < wake )
+    {
+        wake = twiModelNext();
+    }
+    if( wake <= simCycles )
+    {
+        wake = simCycles + 1;
+    }
+
+    simSleepCycles += wake - simCycles;
+    simAdvance( wake - simCycles );
+}
+
+void simRTCWritten( const uint8_t *regs )
+{
+    double now = msfGenTime( simCycles );
+    struct tm tm;
+
+    memset( &tm, 0, sizeof(tm) );
+    tm.tm_sec = BCD_TO_BIN( regs[RTC_REG_SECONDS] );
+    tm.tm_min = BCD_TO_BIN( regs[RTC_REG_MINUTES] );
+    tm.tm_hour = BCD_TO_BIN( regs[RTC_REG_HOURS] );
+    tm.tm_mday = BCD_TO_BIN( regs[RTC_REG_DATE] );
+    tm.tm_mon = BCD_TO_BIN( regs[RTC_REG_MONTH] ) - 1;
+    tm.tm_year = BCD_TO_BIN( regs[RTC_REG_YEAR] ) + 100;
+
+    // A minute is written to the RTC at a second tick shortly after its
+    // minute marker, which should be within a few ms of the true second
+    time_t second = (time_t) floor( now + 0.5 );
+    time_t written = timegm( &tm );
+    struct tm truth;
+    gmtime_r( &second, &truth );
+
+    if( written == second && regs[RTC_REG_DAY] == truth.tm_wday + 1 )
+    {
+        goodMinutes++;
+        if( firstLock < 0 )
+        {
+            firstLock = now - config.start;
+        }
+    }
+    else
+    {
+        badMinutes++;
+        if( simVerbose )
+        {
+            printf( "\r\nWrong minute decoded at %.3f\r\n", now - config.start );
+        }
+    }
+}
+
+void simRXFrame( uint64_t a, uint64_t b )
+{
+    double now = msfGenTime( simCycles );
+
+    // The frame is passed on at the minute marker, just after the start
+    // of the next minute
+    time_t minute = (time_t) (60 * floor( (now - 0.5) / 60 + 0.5 )) - 60;
+    uint8_t frameA[60], frameB[60];
+    msfGenFrame( minute, frameA, frameB );
+
+    // Bit 0 is the minute marker so has no data
+    rxFrames++;
+    for( uint8_t n = 1 ; n < 60 && firstLock >= 0 ; n++ )
+    {
+        rxBitErrors += ((a >> (63 - n)) & 1) != frameA[n];
+        rxBitErrors += ((b >> (63 - n)) & 1) != frameB[n];
+        rxBits += 2;
+    }
+
+    // Each parity bit in B makes its range of A bits odd
+    static const struct
+    {
+        uint8_t start, finish, parity;
+    } check[] =
+    {
+        { 17, 24, 54 }, { 25, 35, 55 }, { 36, 38, 56 }, { 39, 51, 57 }
+    };
+    for( uint8_t i = 0 ; i < sizeof(check) / sizeof(check[0]) ; i++ )
+    {
+        uint8_t ones = (b >> (63 - check[i].parity)) & 1;
+        for( uint8_t n = check[i].start ; n <= check[i].finish ; n++ )
+        {
+            ones += (a >> (63 - n)) & 1;
+        }
+        if( !(ones & 1) )
+        {
+            rxParityFails++;
+            break;
+        }
+    }
+}
+
+void simDisplayLine( uint8_t line, const char *text )
+{
+    strcpy( displayLine[line], text );
+
+    // The time is on the second line which is passed last
+    if( line != 1 )
+    {
+        return;
+    }
+
+    char day[4];
+    unsigned date, month, year, hour, minute, second;
+    if( sscanf( displayLine[0], "%3s %u/%u/%u", day, &date, &month, &year ) != 4 ||
+        sscanf( displayLine[1], "%u:%u:%u", &hour, &minute, &second ) != 3 )
+    {
+        return;
+    }
+
+    double now = msfGenTime( simCycles );
+    accountDisplay( now );
+    displayUpdates++;
+
+    struct tm tm;
+    memset( &tm, 0, sizeof(tm) );
+    tm.tm_sec = second;
+    tm.tm_min = minute;
+    tm.tm_hour = hour;
+    tm.tm_mday = date;
+    tm.tm_mon = month - 1;
+    tm.tm_year = year + 100;
+
+    shown = timegm( &tm );
+    shownAt = now;
+
+    // The day name must also be right. If not the display is
+    // treated as showing a time that never matches.
+    gmtime_r( &shown, &tm );
+    if( strcmp( day, dayName[tm.tm_wday] ) != 0 )
+    {
+        shown = -10;
+    }
+
+    double lag = now - shown;
+    if( lag >= 0 && lag < 1 )
+    {
+        displayCorrect++;
+        displayLagTotal += lag;
+        if( lag > displayLagMax )
+        {
+            displayLagMax = lag;
+        }
+    }
+}
+
+static void usage( const char *name )
+{
+    printf( "Usage: %s [options]\n"
+            "  -d hours    duration to simulate (default 24)\n"
+            "  -t time     UTC at start as \"YYYY-MM-DD HH:MM:SS\" (default 2026-01-01 00:00:20)\n"
+            "  -a counts   carrier amplitude in ADC counts (default 36)\n"
+            "  -n counts   RMS noise in ADC counts (default 24)\n"
+            "  -p ppm      CPU clock error (default 0)\n"
+            "  -r ppm      CPU clock drift per hour (default 0)\n"
+            "  -o hz       LO error on top of the CPU clock error (default 0)\n"
+            "  -g depth    carrier fades by this fraction of its amplitude (default 0)\n"
+            "  -G seconds  period of the fading (default 60)\n"
+            "  -i hz       rate of noise impulses (default 0)\n"
+            "  -I counts   peak of the noise impulses in ADC counts (default 100)\n"
+            "  -u dut1     DUT1 in tenths of a second (default -2)\n"
+            "  -b          transmit British Summer Time\n"
+            "  -s seed     noise seed\n"
+            "  -f file     replay unsigned 8 bit ADC samples from a file\n"
+            "  -e file     keep the EEPROM in a file from one run to the next\n"
+            "  -v          show the firmware's serial output\n", name );
+}
+
+int main( int argc, char **argv )
+{
+    double hours = 24;
+    struct tm tm;
+    int opt;
+
+    memset( &tm, 0, sizeof(tm) );
+    tm.tm_year = 126;
+    tm.tm_mday = 1;
+    tm.tm_sec = 20;
+
+    config.start = timegm( &tm );
+    config.amplitude = 36;
+    config.noise = 24;
+    config.dut1 = -2;
+    config.seed = 1;
+    config.fadePeriod = 60;
+    config.impulseAmplitude = 100;
+
+    while( (opt = getopt( argc, argv, "d:t:a:n:p:r:o:g:G:i:I:u:bs:f:e:vh" )) != -1 )
+    {
+        switch( opt )
+        {
+            case 'd':
+                hours = atof( optarg );
+                break;
+
+            case 't':
+                memset( &tm, 0, sizeof(tm) );
+                if( strptime( optarg, "%Y-%m-%d %H:%M:%S", &tm ) == NULL )
+                {
+                    fprintf( stderr, "Bad start time %s\n", optarg );
+                    return 1;
+                }
+                config.start = timegm( &tm );
+                break;
+
+            case 'a':
+                config.amplitude = atof( optarg );
+                break;
+
+            case 'n':
+                config.noise = atof( optarg );
+                break;
+
+            case 'p':
+                config.ppm = atof( optarg );
+                break;
+
+            case 'r':
+                config.drift = atof( optarg );
+                break;
+
+            case 'o':
+                config.loOffset = atof( optarg );
+                break;
+
+            case 'g':
+                config.fadeDepth = atof( optarg );
+                break;
+
+            case 'G':
+                config.fadePeriod = atof( optarg );
+                break;
+
+            case 'i':
+                config.impulseRate = atof( optarg );
+                break;
+
+            case 'I':
+                config.impulseAmplitude = atof( optarg );
+                break;
+
+            case 'u':
+                config.dut1 = atoi( optarg );
+                break;
+
+            case 'b':
+                config.bst = 1;
+                break;
+
+            case 's':
+                config.seed = strtoul( optarg, NULL, 0 );
+                break;
+
+            case 'f':
+                config.file = fopen( optarg, "rb" );
+                if( config.file == NULL )
+                {
+                    perror( optarg );
+                    return 1;
+                }
+                break;
+
+            case 'e':
+                eepromFile = optarg;
+                break;
+
+            case 'v':
+                simVerbose = 1;
+                break;
+
+            case 'h':
+                usage( argv[0] );
+                return 0;
+
+            default:
+                usage( argv[0] );
+                return 1;
+        }
+    }
+
+    msfGenInit( &config );
+    rtcModelInit();
+    eepromLoad();
+    endCycles = (uint64_t) msfGenCycle( config.start + hours * 3600 );
+
+    return firmwareMain();
+}
@@ -0,0 +1,78 @@
+/*
+ * sim.h
+ *
+ * Shared definitions for the host simulation of the MSF clock.
+ *
+ * The firmware runs unmodified, apart from a hook that passes each
+ * frame received to the simulator, against stubs of the TARL drivers.
+ * Simulated time is counted in CPU cycles and only moves forward when
+ * the firmware does something that would take time on the real
+ * hardware: a pass around the main loop, an I2C transfer, a display
+ * update or sleeping until the next interrupt. Each ADC conversion that
+ * falls due is delivered by calling ISR(ADC_vect) with ADCH holding the
+ * next generated sample.
+ *
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+
+// Cost of one pass around the main loop when nothing happens
+#define SIM_LOOP_CYCLES 1600
+
+// An I2C byte at 100kHz including the ACK bit
+#define SIM_I2C_BYTE_CYCLES (9 * (F_CPU / 100000UL))
+
+// The simulated CPU clock in cycles since reset
+extern uint64_t simCycles;
+
+// Move simulated time on, delivering any interrupts that fall due
+void simAdvance( uint32_t cycles );
+
+// Number of CPU cycles spent asleep
+extern uint64_t simSleepCycles;
+
+// Called by the RTC model when a new time has been written
+void simRTCWritten( const uint8_t *regs );
+
+// Called by the firmware with each frame received before it is decoded
+void simRXFrame( uint64_t a, uint64_t b );
+
+// Called by the display model with each line when the display has changed
+void simDisplayLine( uint8_t line, const char *text );
+
+// Passes the display to simDisplayLine if it has changed. Called when the
+// firmware sleeps with the I2C bus idle, by which time it has finished
+// updating the display.
+void displayModelCheck( void );
+
+// Whether serial debug output should be shown
+extern int simVerbose;
+
+// The RTC model lives with the other TARL stubs
+void rtcModelInit( void );
+
+// The CPU cycle of the first falling edge of the RTC's 1Hz output after
+// a cycle, or UINT64_MAX if the output is disabled
+uint64_t rtcModelSQWEdge( uint64_t after );
+
+// The RTC as seen from the TWI bus model. A START, then bytes written
+// or read with the register pointer moving on after each one.
+void rtcModelStart( int bRead );
+void rtcModelWrite( uint8_t data );
+uint8_t rtcModelRead( void );
+
+// A byte written to the LCD's PCF8574 backpack
+void lcdModelWrite( uint8_t port );
+
+// The TWI peripheral
+// twiModelCheck() notices what the firmware has written to TWCR,
+// twiModelNext() returns the CPU cycle the current operation finishes,
+// or UINT64_MAX if there isn't one, and twiModelEvent() finishes it.
+void twiModelCheck( uint64_t now );
+uint64_t twiModelNext( void );
+void twiModelEvent( void );
+
+#endif /* SIM_H_ */
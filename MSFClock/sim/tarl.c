@@ -0,0 +1,352 @@
+/*
+ * tarl.c
+ *
+ * Host simulation stubs for the TARL millisecond timer, I2C, display
+ * and serial drivers, and the models of the devices on the I2C bus.
+ *
+ * Each call costs the simulated time the real driver would block for,
+ * so ADC interrupts keep arriving while the main loop is busy.
+ *
+ * The I2C bus has a model of the DS3231 RTC on it. The LCD is modelled
+ * both at the display driver level and as a PCF8574 backpack driving
+ * an HD44780 for the firmware's own TWI driver, see twibus.c.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "config.h"
+#include "sim.h"
+#include "msfgen.h"
+#include "millis.h"
+#include "i2c.h"
+#include "lcd_twi.h"
+#include "display.h"
+#include "serial.h"
+
+// Writing a character to the LCD through the PCF8574 backpack
+// takes two nibbles each strobed with the enable line
+#define DISPLAY_CHAR_CYCLES (8 * SIM_I2C_BYTE_CYCLES)
+
+// Number of DS3231 registers
+#define RTC_NUM_REGS 0x13
+
+// The DS3231 registers and the true time at which they were last
+// brought up to date. The RTC keeps true time whatever the CPU clock does.
+static uint8_t rtcRegs[RTC_NUM_REGS];
+static double rtcTime;
+
+static char lcd[LCD_HEIGHT][LCD_WIDTH + 1];
+
+// The LCD's cursor and whether anything has been written since the
+// display was last checked
+static uint8_t lcdX, lcdY;
+static int bLCDChanged;
+
+// The RTC's register pointer and whether the next byte written sets it
+static uint8_t rtcPointer;
+static int bRTCPointer;
+
+// The last byte written to the LCD backpack and which nibble is next
+static uint8_t lcdPort;
+static int bLCDLowNibble;
+static uint8_t lcdHighNibble;
+
+void millisInit(void)
+{
+}
+
+uint32_t millis(void)
+{
+    // Each call stands for one pass around the main loop
+    simAdvance( SIM_LOOP_CYCLES );
+    return simCycles / (F_CPU / 1000);
+}
+
+void rtcModelInit( void )
+{
+    // Power on reset state is midnight on 1/1/00
+    memset( rtcRegs, 0, sizeof(rtcRegs) );
+    rtcRegs[RTC_REG_DAY] = 1;
+    rtcRegs[RTC_REG_DATE] = 1;
+    rtcRegs[RTC_REG_MONTH] = 1;
+    rtcRegs[RTC_REG_CONTROL] = 0x1C;  // Square wave output off
+    rtcTime = msfGenTime( 0 );
+}
+
+// Counts the RTC on by however many whole seconds have passed
+static void rtcUpdate( void )
+{
+    time_t elapsed = (time_t) (msfGenTime( simCycles ) - rtcTime);
+
+    // Only touch the registers when a second has gone by so that a time
+    // written a register at a time is not normalised half way through
+    if( elapsed > 0 )
+    {
+        struct tm tm;
+        memset( &tm, 0, sizeof(tm) );
+        tm.tm_sec = BCD_TO_BIN( rtcRegs[RTC_REG_SECONDS] );
+        tm.tm_min = BCD_TO_BIN( rtcRegs[RTC_REG_MINUTES] );
+        tm.tm_hour = BCD_TO_BIN( rtcRegs[RTC_REG_HOURS] );
+        tm.tm_mday = BCD_TO_BIN( rtcRegs[RTC_REG_DATE] );
+        tm.tm_mon = BCD_TO_BIN( rtcRegs[RTC_REG_MONTH] ) - 1;
+        tm.tm_year = BCD_TO_BIN( rtcRegs[RTC_REG_YEAR] ) + 100;
+
+        time_t before = timegm( &tm );
+        time_t after = before + elapsed;
+        gmtime_r( &after, &tm );
+
+        rtcRegs[RTC_REG_SECONDS] = BIN_TO_BCD( tm.tm_sec );
+        rtcRegs[RTC_REG_MINUTES] = BIN_TO_BCD( tm.tm_min );
+        rtcRegs[RTC_REG_HOURS] = BIN_TO_BCD( tm.tm_hour );
+        rtcRegs[RTC_REG_DAY] = ((rtcRegs[RTC_REG_DAY] - 1 + after / 86400 - before / 86400) % 7) + 1;
+        rtcRegs[RTC_REG_DATE] = BIN_TO_BCD( tm.tm_mday );
+        rtcRegs[RTC_REG_MONTH] = BIN_TO_BCD( tm.tm_mon + 1 );
+        rtcRegs[RTC_REG_YEAR] = BIN_TO_BCD( tm.tm_year % 100 );
+
+        rtcTime += elapsed;
+    }
+}
+
+uint64_t rtcModelSQWEdge( uint64_t after )
+{
+    if( rtcRegs[RTC_REG_CONTROL] & (1<<RTC_CONTROL_INTCN) )
+    {
+        return UINT64_MAX;
+    }
+
+    // The output falls as the seconds count, which restarts when the
+    // seconds are written
+    double seconds = floor( msfGenTime( after ) - rtcTime ) + 1;
+    if( seconds < 1 )
+    {
+        seconds = 1;
+    }
+
+    // Rounding could put the edge at or before the cycle asked about
+    uint64_t edge;
+    while( (edge = (uint64_t) ceil( msfGenCycle( rtcTime + seconds ) )) <= after )
+    {
+        seconds++;
+    }
+    return edge;
+}
+
+void i2cInit(void)
+{
+}
+
+// Writes a register bringing the time up to date first
+static void rtcWriteRegister( uint8_t reg, uint8_t data )
+{
+    if( reg <= RTC_REG_YEAR )
+    {
+        rtcUpdate();
+        rtcRegs[reg] = data;
+
+        // Writing the seconds restarts the countdown to the next second
+        if( reg == RTC_REG_SECONDS )
+        {
+            rtcTime = msfGenTime( simCycles );
+        }
+
+        // The firmware writes the whole time ending with the year
+        if( reg == RTC_REG_YEAR )
+        {
+            simRTCWritten( rtcRegs );
+        }
+    }
+    else
+    {
+        rtcRegs[reg] = data;
+    }
+}
+
+void rtcModelStart( int bRead )
+{
+    // The time is latched at the start so a block read is all from the
+    // same second
+    rtcUpdate();
+    bRTCPointer = !bRead;
+}
+
+void rtcModelWrite( uint8_t data )
+{
+    if( bRTCPointer )
+    {
+        rtcPointer = data % RTC_NUM_REGS;
+        bRTCPointer = 0;
+    }
+    else
+    {
+        rtcWriteRegister( rtcPointer, data );
+        rtcPointer = (rtcPointer + 1) % RTC_NUM_REGS;
+    }
+}
+
+uint8_t rtcModelRead( void )
+{
+    uint8_t data = rtcRegs[rtcPointer];
+    rtcPointer = (rtcPointer + 1) % RTC_NUM_REGS;
+    return data;
+}
+
+uint8_t i2cReadRegister( uint8_t address, uint8_t reg, uint8_t *data )
+{
+    // Start, address, register, repeated start, address, data, stop
+    simAdvance( 6 * SIM_I2C_BYTE_CYCLES );
+
+    if( address != RTC_ADDRESS || reg >= RTC_NUM_REGS )
+    {
+        return 1;
+    }
+
+    rtcUpdate();
+    *data = rtcRegs[reg];
+    return 0;
+}
+
+uint8_t i2cWriteRegister( uint8_t address, uint8_t reg, uint8_t data )
+{
+    // Start, address, register, data, stop
+    simAdvance( 4 * SIM_I2C_BYTE_CYCLES );
+
+    if( address != RTC_ADDRESS || reg >= RTC_NUM_REGS )
+    {
+        return 1;
+    }
+
+    rtcWriteRegister( reg, data );
+    return 0;
+}
+
+void displayInit(void)
+{
+    memset( lcd, ' ', sizeof(lcd) );
+    for( uint8_t line = 0 ; line < LCD_HEIGHT ; line++ )
+    {
+        lcd[line][LCD_WIDTH] = '\0';
+    }
+}
+
+void displayText( uint8_t line, const char *text, uint8_t bClearEOL )
+{
+    uint8_t len = 0;
+
+    if( line >= LCD_HEIGHT )
+    {
+        return;
+    }
+
+    while( len < LCD_WIDTH && text[len] )
+    {
+        lcd[line][len] = text[len];
+        len++;
+    }
+    if( bClearEOL )
+    {
+        memset( &lcd[line][len], ' ', LCD_WIDTH - len );
+        len = LCD_WIDTH;
+    }
+
+    // Cursor positioning command followed by the characters
+    simAdvance( (len + 1) * DISPLAY_CHAR_CYCLES );
+
+    lcdX = len;
+    lcdY = line;
+    bLCDChanged = 1;
+}
+
+void displayCursor( uint8_t x, uint8_t y )
+{
+    simAdvance( DISPLAY_CHAR_CYCLES );
+
+    lcdX = x;
+    lcdY = y;
+}
+
+// Writes a character at the cursor which then moves on
+static void lcdWriteChar( char c )
+{
+    if( lcdY < LCD_HEIGHT && lcdX < LCD_WIDTH )
+    {
+        lcd[lcdY][lcdX] = c;
+        bLCDChanged = 1;
+    }
+    lcdX++;
+}
+
+void displayWriteChar( char c )
+{
+    simAdvance( DISPLAY_CHAR_CYCLES );
+    lcdWriteChar( c );
+}
+
+void lcdModelWrite( uint8_t port )
+{
+    // The HD44780 reads a nibble from D4-D7 as the enable line falls,
+    // high nibble first
+    if( (lcdPort & LCD_TWI_ENABLE) && !(port & LCD_TWI_ENABLE) )
+    {
+        uint8_t nibble = lcdPort >> 4;
+
+        if( !bLCDLowNibble )
+        {
+            lcdHighNibble = nibble;
+            bLCDLowNibble = 1;
+        }
+        else
+        {
+            uint8_t value = (lcdHighNibble << 4) | nibble;
+            bLCDLowNibble = 0;
+
+            if( lcdPort & LCD_TWI_RS )
+            {
+                lcdWriteChar( value );
+            }
+            else if( value & LCD_TWI_SET_ADDRESS )
+            {
+                // Only the display address command is modelled
+                value &= ~LCD_TWI_SET_ADDRESS;
+                lcdY = (value & LCD_TWI_LINE_2) ? 1 : 0;
+                lcdX = value & ~LCD_TWI_LINE_2;
+            }
+        }
+    }
+    lcdPort = port;
+}
+
+void displayModelCheck( void )
+{
+    if( bLCDChanged )
+    {
+        bLCDChanged = 0;
+        for( uint8_t line = 0 ; line < LCD_HEIGHT ; line++ )
+        {
+            simDisplayLine( line, lcd[line] );
+        }
+    }
+}
+
+void serialInit( uint32_t baud )
+{
+}
+
+void serialTXString( char *string )
+{
+    if( simVerbose )
+    {
+        fputs( string, stdout );
+    }
+}
+
+uint8_t serialRXRead( uint8_t *data )
+{
+    // Nothing is ever received
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * twibus.c
+ *
+ * Host simulation of the ATmega328P TWI peripheral as a bus master
+ * with the RTC and the LCD backpack on the bus.
+ *
+ * The firmware starts each operation by writing TWCR with TWINT set.
+ * There is no hook on register writes so the model keeps TWWC, which
+ * is read only on the real part, set in TWCR. Any write by the firmware
+ * clears it and is picked up by twiModelCheck(). Each START, address
+ * or data byte then takes an I2C byte time, after which TWINT is set,
+ * TWSR holds the status and the interrupt is called if it is enabled.
+ * A STOP happens straight away.
+ *
+ */
+
+#include <stdint.h>
+
+#include <avr/interrupt.h>
+#include <util/twi.h>
+
+#include "config.h"
+#include "sim.h"
+
+typedef enum
+{
+    TWI_IDLE,           // No START yet
+    TWI_ADDRESS,        // START sent so the next byte is an address
+    TWI_TRANSMIT,       // Writing to a device
+    TWI_RECEIVE,        // Reading from a device
+    TWI_NACKED          // Nobody answered so waiting for a STOP
+} TWI_STATE;
+
+static TWI_STATE state;
+
+// The device addressed
+static uint8_t device;
+
+// When the current operation finishes and the TWCR value that started it
+static uint64_t eventCycle = UINT64_MAX;
+static uint8_t command;
+
+void twiModelCheck( uint64_t now )
+{
+    uint8_t twcr = TWCR;
+
+    if( twcr & (1<<TWWC) )
+    {
+        return;
+    }
+
+    // Writing a 1 to TWINT clears it and starts the next operation
+    TWCR = (twcr & ~(1<<TWINT)) | (1<<TWWC);
+    if( !(twcr & (1<<TWINT)) || !(twcr & (1<<TWEN)) )
+    {
+        return;
+    }
+
+    if( twcr & (1<<TWSTO) )
+    {
+        state = TWI_IDLE;
+        TWCR &= ~(1<<TWSTO);
+
+        // A START as well is sent after the STOP
+        if( !(twcr & (1<<TWSTA)) )
+        {
+            return;
+        }
+    }
+
+    command = twcr;
+    eventCycle = now + SIM_I2C_BYTE_CYCLES;
+}
+
+uint64_t twiModelNext( void )
+{
+    return eventCycle;
+}
+
+void twiModelEvent( void )
+{
+    uint64_t now = eventCycle;
+    uint8_t status;
+
+    eventCycle = UINT64_MAX;
+
+    if( command & (1<<TWSTA) )
+    {
+        status = (state == TWI_IDLE) ? TW_START : TW_REP_START;
+        state = TWI_ADDRESS;
+    }
+    else if( state == TWI_ADDRESS )
+    {
+        uint8_t sla = TWDR;
+        int bRead = (sla & 1) == TW_READ;
+
+        device = sla >> 1;
+        if( device == RTC_ADDRESS || (device == LCD_I2C_ADDRESS && !bRead) )
+        {
+            if( device == RTC_ADDRESS )
+            {
+                rtcModelStart( bRead );
+            }
+            state = bRead ? TWI_RECEIVE : TWI_TRANSMIT;
+            status = bRead ? TW_MR_SLA_ACK : TW_MT_SLA_ACK;
+        }
+        else
+        {
+            state = TWI_NACKED;
+            status = bRead ? TW_MR_SLA_NACK : TW_MT_SLA_NACK;
+        }
+    }
+    else if( state == TWI_TRANSMIT )
+    {
+        if( device == RTC_ADDRESS )
+        {
+            rtcModelWrite( TWDR );
+        }
+        else
+        {
+            lcdModelWrite( TWDR );
+        }
+        status = TW_MT_DATA_ACK;
+    }
+    else if( state == TWI_RECEIVE )
+    {
+        TWDR = rtcModelRead();
+        status = (command & (1<<TWEA)) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK;
+    }
+    else
+    {
+        status = TW_BUS_ERROR;
+    }
+    TWSR = status;
+
+    TWCR |= (1<<TWINT) | (1<<TWWC);
+    if( TWCR & (1<<TWIE) )
+    {
+        TWI_vect();
+
+        // Start whatever the interrupt asked for next
+        twiModelCheck( now );
+    }
+}
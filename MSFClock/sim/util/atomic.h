@@ -0,0 +1,18 @@
+/*
+ * util/atomic.h
+ *
+ * Host simulation stand-in for avr-libc atomic blocks.
+ * Interrupts are only ever delivered between firmware statements so
+ * the block just runs once.
+ *
+ */
+
+#ifndef SIM_UTIL_ATOMIC_H_
+#define SIM_UTIL_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#define ATOMIC_BLOCK(type) for( int atomicOnce = 1 ; atomicOnce ; atomicOnce = 0 )
+
+#endif /* SIM_UTIL_ATOMIC_H_ */
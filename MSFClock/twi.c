@@ -0,0 +1,276 @@
+/*
+ * twi.c
+ *
+ * Interrupt driven queue of TWI (I2C) transactions.
+ *
+ * The main loop queues transactions and carries on. The TWI interrupt
+ * works through the queue a byte at a time so the bus runs in the
+ * background and the receive path never waits for it. Callbacks are
+ * called from twiPoll() in the main loop rather than from the interrupt.
+ *
+ * A transaction writes up to TWI_DATA_LEN bytes and then, after a
+ * repeated START, reads up to TWI_DATA_LEN bytes. Reading a block of
+ * registers takes one START, address and register byte for the whole
+ * block. The DS3231 latches its time registers at the START of a read
+ * so a block read is coherent across a seconds rollover.
+ *
+ * Queuing never waits. If the queue is full the transaction isn't
+ * queued and the caller tries again later, so the receive path is never
+ * held up by the bus.
+ *
+ * The bit rate is set by the TARL I2C driver's i2cInit(). The TARL
+ * driver's polled calls must not be used once transactions have been
+ * queued.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/twi.h>
+
+#include "config.h"
+#include "twi.h"
+#include "profile.h"
+
+// The queue holds one less transaction than its length. Redrawing the
+// whole display takes 12 and what doesn't fit goes with the next update,
+// but a typical update is one transaction for the seconds.
+// Length must be a power of 2
+#define TWI_QUEUE_LEN 8
+
+typedef struct
+{
+    uint8_t address;
+    uint8_t writeLen;
+    uint8_t readLen;
+    uint8_t result;
+    uint8_t data[TWI_DATA_LEN];     // Bytes to write, then the bytes read
+    TWI_CALLBACK callback;
+} TWI_TRANSACTION;
+
+// The queue. The main loop adds transactions at the head and removes
+// them from the tail once they are finished. The interrupt works on
+// the active one. All are single bytes so can be read and written
+// without disabling interrupts.
+static TWI_TRANSACTION twiQueue[TWI_QUEUE_LEN];
+static volatile uint8_t twiHead, twiActive, twiTail;
+
+// True while the interrupt is working through the queue
+static volatile bool bTWIBusy;
+
+// Bytes written or read so far in the active transaction
+static uint8_t twiCount;
+
+// TWCR values to carry on, to send a START, to finish with a STOP and
+// to let go of the bus without one
+#define TWI_NEXT    ((1<<TWINT) | (1<<TWEN) | (1<<TWIE))
+#define TWI_START   ((1<<TWINT) | (1<<TWSTA) | (1<<TWEN) | (1<<TWIE))
+#define TWI_STOP    ((1<<TWINT) | (1<<TWSTO) | (1<<TWEN))
+#define TWI_RELEASE ((1<<TWINT) | (1<<TWEN))
+
+// Finishes the active transaction and starts the next one if there is
+// one. A STOP and START together are sent as a STOP followed by a START.
+// Without a STOP, after losing arbitration when the bus belongs to the
+// other master, the START waits for the bus to be free.
+static void twiFinish( uint8_t result, bool bStop )
+{
+    twiQueue[twiActive].result = result;
+
+    uint8_t active = (twiActive + 1) & (TWI_QUEUE_LEN - 1);
+    twiActive = active;
+
+    if( active != twiHead )
+    {
+        TWCR = TWI_START | (bStop ? (1<<TWSTO) : 0);
+    }
+    else
+    {
+        TWCR = bStop ? TWI_STOP : TWI_RELEASE;
+        bTWIBusy = false;
+    }
+}
+
+ISR (TWI_vect)
+{
+    PROFILE_START( PROFILE_TWI_ISR );
+
+    TWI_TRANSACTION *t = &twiQueue[twiActive];
+
+    switch( TW_STATUS )
+    {
+        case TW_START:
+            twiCount = 0;
+
+            // Only address for reading if there is nothing to write
+            TWDR = (t->address << 1) | (t->writeLen ? TW_WRITE : TW_READ);
+            TWCR = TWI_NEXT;
+            break;
+
+        case TW_REP_START:
+            twiCount = 0;
+            TWDR = (t->address << 1) | TW_READ;
+            TWCR = TWI_NEXT;
+            break;
+
+        case TW_MT_SLA_ACK:
+        case TW_MT_DATA_ACK:
+            if( twiCount < t->writeLen )
+            {
+                TWDR = t->data[twiCount++];
+                TWCR = TWI_NEXT;
+            }
+            else if( t->readLen )
+            {
+                TWCR = TWI_START;
+            }
+            else
+            {
+                twiFinish( 0, true );
+            }
+            break;
+
+        case TW_MR_DATA_ACK:
+            t->data[twiCount++] = TWDR;
+            // Fall through
+
+        case TW_MR_SLA_ACK:
+            // ACK every byte except the last
+            TWCR = TWI_NEXT | ((twiCount < t->readLen - 1) ? (1<<TWEA) : 0);
+            break;
+
+        case TW_MR_DATA_NACK:
+            t->data[twiCount++] = TWDR;
+            twiFinish( 0, true );
+            break;
+
+        case TW_MT_ARB_LOST:
+            // Also TW_MR_ARB_LOST. The other master has the bus.
+            twiFinish( 1, false );
+            break;
+
+        default:
+            // No acknowledgement or a bus error
+            twiFinish( 1, true );
+            break;
+    }
+
+    PROFILE_END( PROFILE_TWI_ISR );
+}
+
+// Returns the next free transaction or NULL if the queue is full
+static TWI_TRANSACTION *twiNewTransaction( uint8_t address, TWI_CALLBACK callback )
+{
+    // Only twiPoll() makes room so call it in case anything has finished
+    twiPoll();
+    if( ((twiHead + 1) & (TWI_QUEUE_LEN - 1)) == twiTail )
+    {
+        return NULL;
+    }
+
+    TWI_TRANSACTION *t = &twiQueue[twiHead];
+    t->address = address;
+    t->writeLen = 0;
+    t->readLen = 0;
+    t->callback = callback;
+
+    return t;
+}
+
+// Adds the new transaction to the queue and starts the bus if it is idle
+static void twiSubmit( void )
+{
+    ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+    {
+        twiHead = (twiHead + 1) & (TWI_QUEUE_LEN - 1);
+        if( !bTWIBusy )
+        {
+            bTWIBusy = true;
+            TWCR = TWI_START;
+        }
+    }
+}
+
+// Queue a write of len bytes
+// Returns false if the queue is full
+bool twiQueueWrite( uint8_t address, const uint8_t *data, uint8_t len, TWI_CALLBACK callback )
+{
+    TWI_TRANSACTION *t = twiNewTransaction( address, callback );
+    if( t == NULL )
+    {
+        return false;
+    }
+
+    for( uint8_t i = 0 ; i < len && i < TWI_DATA_LEN ; i++ )
+    {
+        t->data[t->writeLen++] = data[i];
+    }
+
+    twiSubmit();
+    return true;
+}
+
+// Queue a write of len registers starting at reg
+// Returns false if the queue is full
+bool twiQueueWriteRegisters( uint8_t address, uint8_t reg, const uint8_t *data, uint8_t len, TWI_CALLBACK callback )
+{
+    TWI_TRANSACTION *t = twiNewTransaction( address, callback );
+    if( t == NULL )
+    {
+        return false;
+    }
+
+    t->data[t->writeLen++] = reg;
+    for( uint8_t i = 0 ; i < len && i < TWI_DATA_LEN - 1 ; i++ )
+    {
+        t->data[t->writeLen++] = data[i];
+    }
+
+    twiSubmit();
+    return true;
+}
+
+// Queue a read of len registers starting at reg
+// Returns false if the queue is full
+bool twiQueueReadRegisters( uint8_t address, uint8_t reg, uint8_t len, TWI_CALLBACK callback )
+{
+    TWI_TRANSACTION *t = twiNewTransaction( address, callback );
+    if( t == NULL )
+    {
+        return false;
+    }
+
+    t->data[0] = reg;
+    t->writeLen = 1;
+    t->readLen = (len < TWI_DATA_LEN) ? len : TWI_DATA_LEN;
+
+    twiSubmit();
+    return true;
+}
+
+// Call the callbacks of any transactions that have finished
+// The transaction is freed before its callback is called so that the
+// callback can queue another, which can call back in here
+void twiPoll()
+{
+    while( twiTail != twiActive )
+    {
+        TWI_TRANSACTION *t = &twiQueue[twiTail];
+        TWI_CALLBACK callback = t->callback;
+        uint8_t result = t->result;
+        uint8_t data[TWI_DATA_LEN];
+
+        if( callback )
+        {
+            memcpy( data, t->data, sizeof( data ) );
+        }
+
+        twiTail = (twiTail + 1) & (TWI_QUEUE_LEN - 1);
+
+        if( callback )
+        {
+            callback( result, data );
+        }
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ * twi.h
+ *
+ * Interrupt driven queue of TWI (I2C) transactions.
+ * The bus is set up by the TARL I2C driver.
+ *
+ */
+
+
+#ifndef TWI_H_
+#define TWI_H_
+
+// The most bytes a transaction can write or read
+// Enough for the RTC time and register address, or three LCD characters
+#define TWI_DATA_LEN 12
+
+// Called from twiPoll() when a transaction has finished
+// result is 0 on success and data holds any bytes read
+typedef void (*TWI_CALLBACK)( uint8_t result, const uint8_t *data );
+
+// Queue a write of len bytes
+// Returns false if the queue is full
+bool twiQueueWrite( uint8_t address, const uint8_t *data, uint8_t len, TWI_CALLBACK callback );
+
+// Queue a write of len registers starting at reg
+// Returns false if the queue is full
+bool twiQueueWriteRegisters( uint8_t address, uint8_t reg, const uint8_t *data, uint8_t len, TWI_CALLBACK callback );
+
+// Queue a read of len registers starting at reg
+// Returns false if the queue is full
+bool twiQueueReadRegisters( uint8_t address, uint8_t reg, uint8_t len, TWI_CALLBACK callback );
+
+// Call the callbacks of any transactions that have finished
+void twiPoll();
+
+#endif /* TWI_H_ */